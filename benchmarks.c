@@ -0,0 +1,557 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Benchmark suite for the headers in include/
+
+ use: benchmarks [-r trials] [-x scale] [-f name] [-o file.json] [-c baseline.json] [-t percent]
+
+Runs each benchmark once to warm up and then -r times (default 5) and
+writes min/median/p90/max ns per operation as JSON (bench.h) to -o, or
+standard output. -x multiplies the operation counts, -f only runs the
+benchmarks with the string in their name. With -c the medians are compared
+to a saved run and the ones more than -t percent (default 10) slower are
+printed as REGRESSION - the exit status is 1 if there are any. The baseline
+is read before -o is written, so they can be the same file.
+
+ owq_*		producer thread to consumer thread through a short and a long
+		queue, and a ping-pong between two threads through two queues
+		with the round trip latency of each message in a histogram
+ dlist_*	enq/deq, walking with dlist_next, dlist_search, dlist_msort, and
+		scans of a 10^6 node list linked in random memory order with
+		dlist_next, dlist_after, dlist_search and dlist_search_many
+ hash_*		the hash.h functions on short random words and on keys
+ mmalloc_*	mmalloc/mfree pairs small and large, and a batch of mixed
+		sizes allocated and then freed, next to smalloc for comparison
+
+"make bench" builds it and writes bench.json, "make bench BASELINE=old.json"
+also compares.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "bench.h"
+#include "xoshiro.h"
+#include "smalloc.h"
+
+typedef int owq_element_t;
+#include "owq.h"
+typedef struct owq_struct owq_t;
+
+typedef struct dnode {
+	struct dnode *n, *p;
+	long key;
+} dlist_t;
+#define dlist_key_t long
+#define dlist_compare(x, k) ((x)->key != (k))
+#define dlist_leq(x, y) ((x)->key <= (y)->key)
+#define DLIST_MERGE
+#include "dlinklist.h"
+
+#define HLISTSIZE 10007
+#include "hash.h"
+
+#define TRIALS 5
+#define MAXBENCH 32
+#define SPINS 100		//failed queue ops before a thread yields
+#define SHORTQ 64
+#define LONGQ (64 * 1024)
+#define NODES (100 * 1000)	//list length for walk, search and sort
+#define LONGLIST (1000 * 1000)	//list in random memory order for the scans
+#define NWORDS 4096
+#define BATCH 1024		//blocks in the mixed size mmalloc batch
+
+#define barrier() asm volatile("" ::: "memory")
+
+static volatile unsigned long sink;	//so results are not optimized away
+static long scale = 1;
+
+/* owq */
+
+struct queues {
+	owq_t *a, *b;		//a carries requests, b replies
+	long ops;
+	struct bench *lat;
+};
+
+static int qa[LONGQ], qb[LONGQ];
+static owq_t shortq = {.h = 0,.t = 0,.v = qa,.z = SHORTQ };
+static owq_t longq = {.h = 0,.t = 0,.v = qa,.z = LONGQ };
+static owq_t pingq = {.h = 0,.t = 0,.v = qa,.z = SHORTQ };
+static owq_t pongq = {.h = 0,.t = 0,.v = qb,.z = SHORTQ };
+
+static inline void spin(int *spins)
+{
+	barrier();
+	if (++*spins > SPINS) {
+		sched_yield();
+		*spins = 0;
+	}
+}
+
+static void *producer(void *v)
+{
+	struct queues *q = (struct queues *)v;
+	int i, spins = 0;
+
+	for (i = 0; i < q->ops; i++)
+		while (owq_enq(q->a, i))
+			spin(&spins);
+	return NULL;
+}
+
+static void *echo(void *v)
+{
+	struct queues *q = (struct queues *)v;
+	int i, x, spins = 0;
+
+	for (i = 0; i < q->ops; i++) {
+		while (owq_deq(q->a, &x))
+			spin(&spins);
+		while (owq_enq(q->b, x))
+			spin(&spins);
+	}
+	return NULL;
+}
+
+static void start(pthread_t *t, void *(*f)(void *), void *arg)
+{
+	if (pthread_create(t, NULL, f, arg)) {
+		fprintf(stderr, "Can't create thread\n");
+		exit(1);
+	}
+}
+
+static void owq_stream(void *v, long ops)
+{
+	struct queues *q = (struct queues *)v;
+	pthread_t t;
+	int i, x, spins = 0;
+
+	q->a->h = q->a->t = 0;
+	q->ops = ops;
+	start(&t, producer, q);
+	for (i = 0; i < ops; i++) {
+		while (owq_deq(q->a, &x))
+			spin(&spins);
+		if (x != i) {
+			fprintf(stderr, "owq sequence error %d != %d\n", x, i);
+			exit(1);
+		}
+	}
+	pthread_join(t, NULL);
+}
+
+static void owq_pingpong(void *v, long ops)
+{
+	struct queues *q = (struct queues *)v;
+	pthread_t t;
+	int i, x, spins = 0;
+
+	q->a->h = q->a->t = q->b->h = q->b->t = 0;
+	q->ops = ops;
+	start(&t, echo, q);
+	for (i = 0; i < ops; i++) {
+		uint64_t c = bench_ticks();
+		while (owq_enq(q->a, i))
+			spin(&spins);
+		while (owq_deq(q->b, &x))
+			spin(&spins);
+		bench_lat(q->lat, bench_ticks() - c);
+		if (x != i) {
+			fprintf(stderr, "owq ping-pong error %d != %d\n", x, i);
+			exit(1);
+		}
+	}
+	pthread_join(t, NULL);
+}
+
+/* dlinklist */
+
+struct lists {
+	dlist_t *nodes;
+	dlist_t *anchor;
+	long n;
+};
+
+static void make_list(struct lists *l, long n, uint64_t seed)
+{
+	struct xoshiro r;
+	long i;
+
+	xo_seed(&r, seed, 0);
+	l->n = n;
+	l->nodes = (dlist_t *)mmalloc(n * sizeof(dlist_t), "list nodes");
+	dlist_init(&l->anchor);
+	for (i = 0; i < n; i++) {
+		l->nodes[i].key = xo_below(&r, n);
+		dlist_enq(&l->anchor, &l->nodes[i]);
+	}
+}
+
+// linked in a random order so each step is a cache miss, as in a list built over time
+static void make_scattered(struct lists *l, long n, uint64_t seed)
+{
+	struct xoshiro r;
+	long i, j, *order = (long *)mmalloc(n * sizeof(long), "list order");
+
+	xo_seed(&r, seed, 0);
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		long t = order[i];
+		j = xo_below(&r, i + 1);
+		order[i] = order[j];
+		order[j] = t;
+	}
+	l->n = n;
+	l->nodes = (dlist_t *)mmalloc(n * sizeof(dlist_t), "list nodes");
+	dlist_init(&l->anchor);
+	for (i = 0; i < n; i++) {
+		l->nodes[order[i]].key = i;
+		dlist_enq(&l->anchor, &l->nodes[order[i]]);
+	}
+	mfree(order);
+}
+
+static void dlist_queue(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	dlist_t *anchor, *x;
+	long i, k;
+
+	dlist_init(&anchor);
+	for (i = 0; i < 64; i++)
+		dlist_enq(&anchor, &l->nodes[i]);
+	for (i = 0; i < ops; i += 2) {	//an enq and a deq
+		x = dlist_deq(&anchor);
+		dlist_enq(&anchor, x);
+	}
+	for (k = 0; (x = dlist_deq(&anchor)); k++) ;
+	sink += k;
+}
+
+static void dlist_walk(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	dlist_t *x;
+	long i, sum = 0;
+
+	for (i = 0; i < ops; i += l->n)
+		for (x = NULL; (x = dlist_next(&l->anchor, x));)
+			sum += x->key;
+	sink += sum;
+}
+
+// ops is nodes compared: each search for a missing key goes over the whole list
+static void dlist_find(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	long i;
+
+	for (i = 0; i < ops; i += l->n)
+		sink += (unsigned long)dlist_search(&l->anchor, NULL, -1);
+}
+
+static void dlist_walk_after(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	dlist_t *x;
+	long i, sum = 0;
+
+	for (i = 0; i < ops; i += l->n)
+		for (x = dlist_first(&l->anchor); x; x = dlist_after(&l->anchor, x))
+			sum += x->key;
+	sink += sum;
+}
+
+// ops is node and key comparisons, DLIST_BATCH missing keys per pass
+static void dlist_find_many(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	dlist_key_t k[DLIST_BATCH];
+	dlist_t *found[DLIST_BATCH];
+	long i;
+
+	for (i = 0; i < DLIST_BATCH; i++)
+		k[i] = -1 - i;
+	for (i = 0; i < ops; i += l->n * DLIST_BATCH)
+		sink += dlist_search_many(&l->anchor, k, DLIST_BATCH, found);
+}
+
+// ops is nodes sorted, the list is shuffled back by key each time
+static void dlist_sort(void *v, long ops)
+{
+	struct lists *l = (struct lists *)v;
+	struct xoshiro r;
+	long i, j;
+
+	xo_seed(&r, ops, 1);
+	for (i = 0; i < ops; i += l->n) {
+		dlist_init(&l->anchor);
+		for (j = 0; j < l->n; j++) {
+			l->nodes[j].key = xo_below(&r, l->n);
+			dlist_enq(&l->anchor, &l->nodes[j]);
+		}
+		dlist_msort(&l->anchor);
+	}
+}
+
+/* hash.h */
+
+static unsigned char words[NWORDS][16];
+static unsigned long keys[NWORDS];
+
+static void make_words(void)
+{
+	struct xoshiro r;
+	int i, j, len;
+
+	xo_seed(&r, 7, 0);
+	for (i = 0; i < NWORDS; i++) {
+		len = 1 + xo_below(&r, 12);
+		for (j = 0; j < len; j++)
+			words[i][j] = 'a' + xo_below(&r, 26);
+		words[i][len] = 0;
+		keys[i] = (unsigned long)xo_below(&r, 1 << 20) << 32 | xo_below(&r, 1 << 20);
+	}
+}
+
+static void hash_djb(void *v, long ops)
+{
+	unsigned long s = 0;
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++)
+		s += hash(words[i & (NWORDS - 1)]);
+	sink += s;
+}
+
+static void hash_xhash(void *v, long ops)
+{
+	unsigned long s = 0;
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++)
+		s += xhash(words[i & (NWORDS - 1)]);
+	sink += s;
+}
+
+static void hash_2strings(void *v, long ops)
+{
+	unsigned long s = 0;
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++)
+		s += hash2strings(words[i & (NWORDS - 1)], words[(i + 1) & (NWORDS - 1)]);
+	sink += s;
+}
+
+static void hash_bytes(void *v, long ops)
+{
+	unsigned long s = 0;
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++) {
+		unsigned char *w = words[i & (NWORDS - 1)];
+		s += hashbytes(w, strlen((char *)w));
+	}
+	sink += s;
+}
+
+static void hash_key(void *v, long ops)
+{
+	unsigned long s = 0;
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++)
+		s += hashkey(keys[i & (NWORDS - 1)] + s);	//dependent, so it is latency
+	sink += s;
+}
+
+/* allocators */
+
+static void *blocks[BATCH];
+static size_t sizes[BATCH];
+
+static void make_sizes(void)
+{
+	struct xoshiro r;
+	int i;
+
+	xo_seed(&r, 11, 0);
+	for (i = 0; i < BATCH; i++)
+		sizes[i] = 8 << xo_below(&r, 9);	//8 to 2048 bytes
+}
+
+static void mmalloc_small(void *v, long ops)
+{
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++) {
+		char *p = mmalloc(32, "bench small");
+		barrier();
+		mfree(p);
+	}
+}
+
+static void mmalloc_large(void *v, long ops)
+{
+	long i;
+
+	(void)v;
+	for (i = 0; i < ops; i++) {
+		char *p = mmalloc(1 << 20, "bench large");
+		p[0] = 1;
+		barrier();
+		mfree(p);
+	}
+}
+
+// ops is blocks allocated and freed
+static void mmalloc_batch(void *v, long ops)
+{
+	long i, j;
+
+	(void)v;
+	for (i = 0; i < ops; i += BATCH) {
+		for (j = 0; j < BATCH; j++)
+			blocks[j] = mmalloc(sizes[j], "bench batch");
+		for (j = 0; j < BATCH; j++)
+			mfree(blocks[j]);
+	}
+}
+
+static void smalloc_batch(void *v, long ops)
+{
+	long i, j;
+
+	(void)v;
+	for (i = 0; i < ops; i += BATCH) {
+		for (j = 0; j < BATCH; j++)
+			blocks[j] = smalloc(sizes[j], "bench batch");
+		for (j = 0; j < BATCH; j++)
+			sfree(blocks[j]);
+	}
+}
+
+static struct bench results[MAXBENCH];
+static int nresults, trials = TRIALS;
+static char *filter;
+
+static void add(char *name, long ops, void (*f)(void *, long), void *arg)
+{
+	struct bench *b = &results[nresults];
+
+	if (filter && !strstr(name, filter))
+		return;
+	memset(b, 0, sizeof(struct bench));
+	b->name = name;
+	b->ops = ops * scale;
+	b->trials = trials;
+	if (f == owq_pingpong)
+		((struct queues *)arg)->lat = b;
+	bench_run(b, f, arg);
+	fprintf(stderr, "%-20s median %10.3f ns/op  min %10.3f  max %10.3f", name, b->median, b->min, b->max);
+	if (b->samples)
+		fprintf(stderr, "  latency p50 %.0f p99 %.0f p99.9 %.0f ns", b->lat[0], b->lat[2], b->lat[3]);
+	fprintf(stderr, "\n");
+	nresults++;
+}
+
+int main(int argc, char **argv)
+{
+	struct queues sq = { &shortq, NULL, 0, NULL }, lq = { &longq, NULL, 0, NULL };
+	struct queues pp = { &pingq, &pongq, 0, NULL };
+	struct lists small, big, scattered;
+	char *out = NULL, *baseline = NULL;
+	double pct = 10;
+	int c, slower = 0;
+	FILE *f = stdout;
+
+	while ((c = getopt(argc, argv, "r:x:f:o:c:t:")) != -1) {
+		switch (c) {
+		case 'r':
+			trials = atoi(optarg);
+			break;
+		case 'x':
+			scale = atol(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'c':
+			baseline = optarg;
+			break;
+		case 't':
+			pct = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "use: benchmarks [-r trials] [-x scale] [-f name] [-o file.json] "
+				"[-c baseline.json] [-t percent]\n");
+			exit(1);
+		}
+	}
+	if (trials < 1 || trials > BENCH_TRIALS || scale < 1) {
+		fprintf(stderr, "trials are 1 to %d, scale at least 1\n", BENCH_TRIALS);
+		exit(1);
+	}
+	make_list(&small, 64, 1);
+	make_list(&big, NODES, 2);
+	make_scattered(&scattered, LONGLIST, 3);
+	make_words();
+	make_sizes();
+
+	add("owq_short", 1000000, owq_stream, &sq);
+	add("owq_long", 1000000, owq_stream, &lq);
+	add("owq_pingpong", 20000, owq_pingpong, &pp);
+	add("dlist_enq_deq", 10000000, dlist_queue, &small);
+	add("dlist_walk", 10 * NODES, dlist_walk, &big);
+	add("dlist_search", 10 * NODES, dlist_find, &big);
+	add("dlist_msort", NODES, dlist_sort, &big);
+	add("dlist_next_1m", 2 * LONGLIST, dlist_walk, &scattered);
+	add("dlist_after_1m", 2 * LONGLIST, dlist_walk_after, &scattered);
+	add("dlist_search_1m", 2 * LONGLIST, dlist_find, &scattered);
+	add("dlist_search_many_1m", 2 * DLIST_BATCH * LONGLIST, dlist_find_many, &scattered);
+	add("hash_djb", 10000000, hash_djb, NULL);
+	add("hash_xhash", 10000000, hash_xhash, NULL);
+	add("hash_2strings", 10000000, hash_2strings, NULL);
+	add("hash_bytes", 10000000, hash_bytes, NULL);
+	add("hash_key", 10000000, hash_key, NULL);
+	add("mmalloc_small", 1000000, mmalloc_small, NULL);
+	add("mmalloc_large", 10000, mmalloc_large, NULL);
+	add("mmalloc_batch", 100 * BATCH, mmalloc_batch, NULL);
+	add("smalloc_batch", 100 * BATCH, smalloc_batch, NULL);
+
+	//compare first, -o may be the baseline
+	if (baseline && (slower = bench_compare(baseline, results, nresults, pct, stderr)) < 0)
+		fprintf(stderr, "Can't read %s\n", baseline);
+	if (out && !(f = fopen(out, "w"))) {
+		fprintf(stderr, "Can't write %s\n", out);
+		exit(1);
+	}
+	bench_json(f, results, nresults);
+	if (out)
+		fclose(f);
+	mfree(small.nodes);
+	mfree(big.nodes);
+	mfree(scattered.nodes);
+	return slower != 0;
+}
@@ -0,0 +1,220 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Small benchmark harness.
+
+ uint64_t bench_ns(void);      CLOCK_MONOTONIC in nanoseconds
+ uint64_t bench_ticks(void);   rdtsc on x86, bench_ns() elsewhere
+ double bench_tick_ns(void);   nanoseconds per tick, measured once
+
+ void bench_run(struct bench *b, void (*f)(void *arg, long ops), void *arg);
+	calls f(arg, b->ops) once to warm up and then b->trials times,
+	timing each call, and fills in the min/median/p90/max ns per op
+ void bench_lat(struct bench *b, uint64_t ticks);
+	adds one latency sample (in ticks) to b's histogram - an f that
+	times single operations calls it, bench_run clears it before the
+	timed trials and fills in the percentiles after them
+ void bench_json(FILE *f, struct bench *b, int n);
+	writes the results as JSON, one result per line
+ int bench_compare(char *baseline, struct bench *b, int n, double pct, FILE *f);
+	reads a file bench_json wrote and prints a line for each result
+	whose median ns per op moved by more than pct percent. Returns the
+	number that got slower, 0 if none, -1 if the file can't be read.
+
+The latency histogram is log-linear: 8 buckets for each power of 2, so a
+percentile is within 1/8 of the true value and the histogram is a fixed
+size no matter how many samples go in. The clock is read twice per trial
+for throughput; bench_ticks is for timing single operations, where the
+40 or so nanoseconds of a clock_gettime would swamp the result.
+*/
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_TRIALS 32		//most trials per result
+#define BENCH_SUB 3		//2^3 buckets per power of 2
+#define BENCH_BUCKETS (64 << BENCH_SUB)
+
+struct bench {
+	char *name;
+	long ops;		//per trial
+	int trials;
+	double ns[BENCH_TRIALS];	//per op, each trial
+	double min, median, p90, max;
+	// latency, only if bench_lat was called
+	uint64_t hist[BENCH_BUCKETS];
+	uint64_t samples;
+	double lat[5];		//p50, p90, p99, p99.9, max in ns
+};
+
+static inline uint64_t bench_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static inline uint64_t bench_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return bench_ns();
+#endif
+}
+
+static inline double bench_tick_ns(void)
+{
+	static double r;
+	uint64_t t0, c0, t1, c1;
+
+	if (r > 0)
+		return r;
+	t0 = bench_ns();
+	c0 = bench_ticks();
+	do
+		t1 = bench_ns();
+	while (t1 - t0 < 20000000);	//20 ms
+	c1 = bench_ticks();
+	r = c1 > c0 ? (double)(t1 - t0) / (c1 - c0) : 1.0;
+	return r;
+}
+
+static inline unsigned int bench_bucket(uint64_t v)
+{
+	int m;
+
+	if (v < (1 << BENCH_SUB))
+		return v;
+	m = 63 - __builtin_clzl(v);	//v is in [2^m, 2^(m+1))
+	return ((m - BENCH_SUB + 1) << BENCH_SUB) | ((v >> (m - BENCH_SUB)) & ((1 << BENCH_SUB) - 1));
+}
+
+// the middle of bucket i
+static inline double bench_bucket_value(unsigned int i)
+{
+	int m = (i >> BENCH_SUB) + BENCH_SUB - 1;
+
+	if (i < (1 << BENCH_SUB))
+		return i;
+	return ((double)((1UL << m) + ((uint64_t)(i & ((1 << BENCH_SUB) - 1)) << (m - BENCH_SUB)))
+		+ (double)(1UL << (m - BENCH_SUB)) / 2);
+}
+
+static inline void bench_lat(struct bench *b, uint64_t ticks)
+{
+	b->hist[bench_bucket(ticks)]++;
+	b->samples++;
+}
+
+static inline int bench_cmp(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static inline void bench_run(struct bench *b, void (*f)(void *, long), void *arg)
+{
+	double s[BENCH_TRIALS], q[] = { 0.5, 0.9, 0.99, 0.999 }, tick = bench_tick_ns();
+	uint64_t seen;
+	unsigned int i, j;
+	int k;
+
+	if (b->trials < 1 || b->trials > BENCH_TRIALS)
+		b->trials = b->trials < 1 ? 1 : BENCH_TRIALS;
+	f(arg, b->ops);		//warm up caches, the branch predictor and the allocator
+	memset(b->hist, 0, sizeof(b->hist));
+	b->samples = 0;
+	for (k = 0; k < b->trials; k++) {
+		uint64_t t = bench_ns();
+		f(arg, b->ops);
+		b->ns[k] = (double)(bench_ns() - t) / b->ops;
+	}
+	memcpy(s, b->ns, b->trials * sizeof(double));
+	qsort(s, b->trials, sizeof(double), bench_cmp);
+	b->min = s[0];
+	b->median = b->trials & 1 ? s[b->trials / 2] : (s[b->trials / 2 - 1] + s[b->trials / 2]) / 2;
+	b->p90 = s[(b->trials * 9) / 10 < b->trials ? (b->trials * 9) / 10 : b->trials - 1];
+	b->max = s[b->trials - 1];
+	if (!b->samples)
+		return;
+	for (i = j = 0, seen = 0; j < 4 && i < BENCH_BUCKETS; i++) {
+		seen += b->hist[i];
+		while (j < 4 && seen >= q[j] * b->samples)
+			b->lat[j++] = bench_bucket_value(i) * tick;
+	}
+	for (i = BENCH_BUCKETS; i-- > 0;)
+		if (b->hist[i])
+			break;
+	b->lat[4] = bench_bucket_value(i) * tick;
+}
+
+static inline void bench_json(FILE *f, struct bench *b, int n)
+{
+	int i, k;
+
+	fprintf(f, "{\"clock\": \"CLOCK_MONOTONIC\", \"tick_ns\": %.4f, \"results\": [\n", bench_tick_ns());
+	for (i = 0; i < n; i++) {
+		fprintf(f, "{\"name\": \"%s\", \"ops\": %ld, \"trials\": %d, \"min\": %.3f, "
+			"\"median\": %.3f, \"p90\": %.3f, \"max\": %.3f, \"ns\": [",
+			b[i].name, b[i].ops, b[i].trials, b[i].min, b[i].median, b[i].p90, b[i].max);
+		for (k = 0; k < b[i].trials; k++)
+			fprintf(f, "%s%.3f", k ? ", " : "", b[i].ns[k]);
+		fprintf(f, "]");
+		if (b[i].samples)
+			fprintf(f, ", \"latency\": {\"samples\": %lu, \"p50\": %.1f, \"p90\": %.1f, "
+				"\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+				(unsigned long)b[i].samples, b[i].lat[0], b[i].lat[1], b[i].lat[2],
+				b[i].lat[3], b[i].lat[4]);
+		fprintf(f, "}%s\n", i < n - 1 ? "," : "");
+	}
+	fprintf(f, "]}\n");
+}
+
+static inline int bench_compare(char *baseline, struct bench *b, int n, double pct, FILE *f)
+{
+	FILE *in = fopen(baseline, "r");
+	char line[4096], name[256];
+	double old;
+	int i, slower = 0;
+
+	if (!in)
+		return -1;
+	while (fgets(line, sizeof(line), in)) {
+		char *m = strstr(line, "\"median\": ");
+		if (sscanf(line, "{\"name\": \"%255[^\"]\"", name) != 1 || !m)
+			continue;
+		old = atof(m + strlen("\"median\": "));
+		for (i = 0; i < n; i++) {
+			double change;
+			if (strcmp(b[i].name, name) || old <= 0)
+				continue;
+			change = (b[i].median - old) / old * 100;
+			if (change > pct) {
+				fprintf(f, "REGRESSION %-24s %10.3f -> %10.3f ns/op  %+.1f%%\n",
+					name, old, b[i].median, change);
+				slower++;
+			} else if (change < -pct) {
+				fprintf(f, "faster     %-24s %10.3f -> %10.3f ns/op  %+.1f%%\n",
+					name, old, b[i].median, change);
+			}
+		}
+	}
+	fclose(in);
+	return slower;
+}
+#endif
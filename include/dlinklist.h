@@ -25,6 +25,11 @@ granted specifically.
  dlist_init(dlist_t **anchor);  initializes to empty
  int dlist_isempty(dlist_t **anchor); 1 true, 0 false
  dlist_t *dlist_next(dlist_t ** anchor, dlist_t * x); iterator
+ dlist_t *dlist_first(dlist_t **anchor);  head or NULL if empty - check once, then
+ dlist_t *dlist_after(dlist_t **anchor, dlist_t *x);  next or NULL after the tail
+ 	fast iterator: no checks, x must be in the list. It prefetches the node
+	after the one it returns so that miss overlaps the caller's work on x.
+	for (x = dlist_first(&a); x; x = dlist_after(&a, x))
  int dlist_enq(dlist_t **anchor);  returns 0 on fail, 1 on success
  dlist_t dlist_deq(dlist_t **anchor); returns NULL on fail
  dlist_t dlist_pop(dlist_t **anchor) ;   (using the list as a stack)
@@ -35,6 +40,13 @@ granted specifically.
 	if last== NULL then searches for first match
 	else it will search for first match after last
  	so you can iterate looking for all matching elements.
+ int dlist_search_many(dlist_t **anchor, dlist_key_t *k, int m, dlist_t **found)
+ 	found[i] is the first match for k[i] (as dlist_search(anchor, NULL, k[i]))
+	or NULL, returns the number found. One pass for up to DLIST_BATCH keys:
+	a scan of a long list waits on one dependent load per node, so instead
+	of m scans it makes one that compares every key at each node, and it
+	walks in from both ends (n from the head, p from the tail) so two
+	independent loads are in flight at a time.
  dlist_msort is a merge sort - only compiled if dlist_leq(dlist_t *x,dlist_t *y) is defined
  	which returns 1 if x <= y and 0 otherwise.
 dlist_join - not done yet
@@ -79,6 +91,23 @@ INLINE dlist_t *dlist_next(dlist_t ** anchor, dlist_t * x)
 	return (!x ? *anchor : (x->n == *anchor ? (dlist_t *) NULL : x->n));
 }
 
+INLINE dlist_t *dlist_first(dlist_t ** anchor)
+{
+	if (!anchor || !*anchor || (*anchor == (void *)anchor))
+		return NULL;
+	return *anchor;
+}
+
+INLINE dlist_t *dlist_after(dlist_t ** anchor, dlist_t * x)
+{
+	dlist_t *n = x->n;
+
+	if (n == *anchor)
+		return NULL;
+	__builtin_prefetch(n->n);
+	return n;
+}
+
 INLINE int dlist_enq(dlist_t ** anchor, dlist_t * x)
 {
 	dlist_t *head = *anchor;
@@ -179,6 +208,57 @@ INLINE dlist_t *dlist_search(dlist_t ** anchor, dlist_t * last, dlist_key_t k)
 	return NULL;
 }
 
+#ifndef DLIST_BATCH
+#define DLIST_BATCH 16		//keys per pass of dlist_search_many
+#endif
+
+INLINE int dlist_search_many(dlist_t ** anchor, dlist_key_t * k, int m, dlist_t ** found)
+{
+	dlist_t *f, *b, *back[DLIST_BATCH];
+	int i, j, g, left, total = 0;
+
+	if (!anchor || !*anchor || (*anchor == (dlist_t *) anchor)) {
+		for (i = 0; i < m; i++)
+			found[i] = NULL;
+		return 0;
+	}
+	for (j = 0; j < m; j += g) {
+		g = m - j < DLIST_BATCH ? m - j : DLIST_BATCH;
+		for (i = 0; i < g; i++)
+			found[j + i] = back[i] = NULL;
+		// f walks forward from the head and b back from the tail until they meet.
+		// A match of f is the first one. b overwrites its matches, so it ends up
+		// with the first one of its half - used if f found nothing.
+		f = *anchor;
+		b = f->p;
+		left = g;
+		for (;;) {
+			__builtin_prefetch(f->n);
+			__builtin_prefetch(b->p);
+			for (i = 0; i < g; i++)
+				if (!found[j + i] && dlist_compare(f, k[j + i]) == 0) {
+					found[j + i] = f;
+					left--;
+				}
+			if (!left || f == b)
+				break;
+			for (i = 0; i < g; i++)
+				if (dlist_compare(b, k[j + i]) == 0)
+					back[i] = b;
+			if (f->n == b)
+				break;
+			f = f->n;
+			b = b->p;
+		}
+		for (i = 0; i < g; i++) {
+			if (!found[j + i])
+				found[j + i] = back[i];
+			total += found[j + i] != NULL;
+		}
+	}
+	return total;
+}
+
 #endif
 #if defined( DLIST_MERGE)
 
@@ -34,3 +34,22 @@ unsigned int hash2strings(unsigned char *str1, unsigned char *str2)
         return hash % HLISTSIZE;
     }
 
+
+/* djb on a (pointer, length) slice - not reduced, caller picks the table size */
+static inline unsigned long hashbytes(unsigned char *s, int n)
+{
+	unsigned long hash = 5381;
+
+	while (n-- > 0)
+		hash = ((hash << 5) + hash) + *s++;	/* hash * 33 + c */
+
+	return hash;
+}
+
+/* for 64 bit keys packed from small integer ids (markov contexts) - not reduced */
+static inline unsigned long hashkey(unsigned long k)
+{
+	k *= 0x9E3779B97F4A7C15UL;
+
+	return k ^ (k >> 32);
+}
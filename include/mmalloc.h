@@ -1,5 +1,33 @@
-// malloc utility - malloc fails are not recoverable
-static inline char *mmalloc(int n, char *message)
+#ifndef MMALLOC_H
+#define MMALLOC_H
+/*
+ malloc utility - malloc fails are not recoverable
+
+ char *mmalloc(size_t n, char *message);  message says what failed
+ void mfree(void *p);                  free for memory from mmalloc
+
+ Accounting: compile with MMALLOC_ACCOUNTING defined (and -lpthread) and
+ the message of each mmalloc call becomes a tag. Per tag we keep allocation
+ and free counts, live bytes, peak live bytes and a histogram of request
+ sizes by power of 2.
+ void mmalloc_dump(FILE *f);                   print the merged tables
+ void mmalloc_report(FILE *f, unsigned int s); dump every s seconds from a
+                                               background thread
+ void mmalloc_totals(long *allocs, long *live); allocations so far and live
+                                               bytes over all tags and threads
+ The counters are per-thread so the fast path is a thread local hash probe
+ keyed on the message pointer and a few increments - no locks or atomics.
+ The dump adds up the threads (tags with the same text but different
+ pointers are merged). A 16 byte header in front of each block remembers
+ the tag and size so mfree can account for it - so memory from mmalloc
+ must be freed with mfree. Peak is exact for a tag only used in one
+ thread, otherwise it is the larger of the highest per-thread peak and the
+ highest total seen by a dump.
+*/
+
+#ifndef MMALLOC_ACCOUNTING
+
+static inline char *mmalloc(size_t n, char *message)
 {
 	char *r = malloc(n);
 	if (!r) {
@@ -9,3 +37,246 @@ static inline char *mmalloc(int n, char *message)
 	return r;
 }
 
+static inline void mfree(void *p)
+{
+	free(p);
+}
+
+#else
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef MM_TAGS
+#define MM_TAGS 64		//tags per thread - power of 2
+#endif
+#define MM_BUCKETS 64		//histogram bucket k counts sizes in [2^k,2^(k+1))
+
+struct mm_tag {
+	char *message;
+	long allocs;
+	long frees;
+	long live;		//bytes - can go negative if other threads free
+	long peak;
+	long hist[MM_BUCKETS];
+	int threads;		//only used when merging
+	long tpeak;		//largest per-thread peak, when merging
+};
+
+struct mm_thread {
+	struct mm_tag t[MM_TAGS];
+	struct mm_tag other;	//when t fills up
+	int used;
+	struct mm_thread *next;
+};
+
+struct mm_hdr {
+	char *message;
+	long n;
+};
+
+static struct mm_thread *mm_threads;
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct mm_thread *mm_self;
+static struct mm_tag mm_merged[MM_TAGS * 4];	//remembers peaks between dumps
+static int mm_nmerged;
+
+static struct mm_thread *mm_register(void)
+{
+	struct mm_thread *t = calloc(1, sizeof(struct mm_thread));
+	if (!t) {
+		fprintf(stderr, "FAIL MALLOC: Cannot allocate mmalloc accounting\n");
+		exit(-1);
+	}
+	t->other.message = "(other tags)";
+	pthread_mutex_lock(&mm_lock);
+	t->next = mm_threads;
+	mm_threads = t;
+	pthread_mutex_unlock(&mm_lock);
+	mm_self = t;
+	return t;
+}
+
+static inline struct mm_tag *mm_tag(char *message)
+{
+	struct mm_thread *t = mm_self ? mm_self : mm_register();
+	unsigned int i = ((unsigned long)message >> 3) & (MM_TAGS - 1);
+
+	while (t->t[i].message != message) {
+		if (!t->t[i].message) {
+			if (t->used == MM_TAGS - 1)
+				return &t->other;
+			t->used++;
+			__atomic_store_n(&t->t[i].message, message,
+					 __ATOMIC_RELEASE);
+			break;
+		}
+		i = (i + 1) & (MM_TAGS - 1);
+	}
+	return &t->t[i];
+}
+
+static inline char *mmalloc(size_t n, char *message)
+{
+	struct mm_hdr *r = malloc(n + sizeof(struct mm_hdr));
+	struct mm_tag *g;
+	if (!r) {
+		fprintf(stderr, "FAIL MALLOC: Cannot allocate %s\n", message);
+		exit(-1);
+	}
+	r->message = message;
+	r->n = n;
+	g = mm_tag(message);
+	g->allocs++;
+	g->hist[n > 0 ? 63 - __builtin_clzl(n) : 0]++;
+	if ((g->live += n) > g->peak)
+		g->peak = g->live;
+	return (char *)(r + 1);
+}
+
+static inline void mfree(void *p)
+{
+	struct mm_hdr *r;
+	struct mm_tag *g;
+	if (!p)
+		return;
+	r = (struct mm_hdr *)p - 1;
+	g = mm_tag(r->message);
+	g->frees++;
+	g->live -= r->n;
+	free(r);
+}
+
+static struct mm_tag *mm_find(char *message)
+{
+	int i;
+	for (i = 0; i < mm_nmerged; i++)
+		if (mm_merged[i].message == message
+		    || !strcmp(mm_merged[i].message, message))
+			return &mm_merged[i];
+	if (mm_nmerged == MM_TAGS * 4)
+		return NULL;
+	mm_merged[mm_nmerged].message = message;
+	return &mm_merged[mm_nmerged++];
+}
+
+static void mm_add(struct mm_tag *from)
+{
+	struct mm_tag *to;
+	int k;
+	char *message = __atomic_load_n(&from->message, __ATOMIC_ACQUIRE);
+	if (!message || !(to = mm_find(message)))
+		return;
+	to->allocs += from->allocs;
+	to->frees += from->frees;
+	to->live += from->live;
+	to->threads++;
+	if (from->peak > to->tpeak)
+		to->tpeak = from->peak;
+	for (k = 0; k < MM_BUCKETS; k++)
+		to->hist[k] += from->hist[k];
+}
+
+static int mm_bylive(const void *a, const void *b)
+{
+	long x = ((struct mm_tag *)a)->live, y = ((struct mm_tag *)b)->live;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static inline void mmalloc_dump(FILE *f)
+{
+	struct mm_thread *t;
+	struct mm_tag sorted[MM_TAGS * 4];
+	int i, k;
+
+	pthread_mutex_lock(&mm_lock);
+	for (i = 0; i < mm_nmerged; i++) {
+		struct mm_tag *m = &mm_merged[i];
+		m->allocs = m->frees = m->live = 0;
+		m->threads = 0;
+		m->tpeak = 0;
+		memset(m->hist, 0, sizeof(m->hist));
+	}
+	for (t = mm_threads; t; t = t->next) {
+		for (i = 0; i < MM_TAGS; i++)
+			mm_add(&t->t[i]);
+		mm_add(&t->other);
+	}
+	for (i = 0; i < mm_nmerged; i++) {
+		struct mm_tag *m = &mm_merged[i];
+		if (m->tpeak > m->peak)
+			m->peak = m->tpeak;
+		if (m->live > m->peak)
+			m->peak = m->live;
+	}
+	memcpy(sorted, mm_merged, mm_nmerged * sizeof(struct mm_tag));
+	qsort(sorted, mm_nmerged, sizeof(struct mm_tag), mm_bylive);
+
+	fprintf(f, "%-24s %12s %12s %14s %14s\n", "mmalloc tag", "allocs",
+		"frees", "live bytes", "peak bytes");
+	for (i = 0; i < mm_nmerged; i++) {
+		struct mm_tag *m = &sorted[i];
+		if (!m->allocs && !m->frees)
+			continue;
+		fprintf(f, "%-24.24s %12ld %12ld %14ld %14ld\n  sizes",
+			m->message, m->allocs, m->frees, m->live, m->peak);
+		for (k = 0; k < MM_BUCKETS; k++)
+			if (m->hist[k])
+				fprintf(f, " %lu+:%ld", 1UL << k, m->hist[k]);
+		fprintf(f, "\n");
+	}
+	pthread_mutex_unlock(&mm_lock);
+	fflush(f);
+}
+
+static inline void mmalloc_totals(long *allocs, long *live)
+{
+	struct mm_thread *t;
+	int i;
+
+	*allocs = *live = 0;
+	pthread_mutex_lock(&mm_lock);
+	for (t = mm_threads; t; t = t->next) {
+		for (i = 0; i < MM_TAGS; i++) {
+			*allocs += t->t[i].allocs;
+			*live += t->t[i].live;
+		}
+		*allocs += t->other.allocs;
+		*live += t->other.live;
+	}
+	pthread_mutex_unlock(&mm_lock);
+}
+
+struct mm_report {
+	FILE *f;
+	unsigned int seconds;
+};
+
+static void *mm_reporter(void *v)
+{
+	struct mm_report r = *(struct mm_report *)v;
+	free(v);
+	for (;;) {
+		sleep(r.seconds);
+		mmalloc_dump(r.f);
+	}
+	return NULL;
+}
+
+static inline void mmalloc_report(FILE *f, unsigned int seconds)
+{
+	pthread_t t;
+	struct mm_report *r;
+	if (!seconds || !(r = malloc(sizeof(struct mm_report))))
+		return;
+	r->f = f;
+	r->seconds = seconds;
+	if (pthread_create(&t, NULL, mm_reporter, r)) {
+		fprintf(stderr, "mmalloc: cannot start report thread\n");
+		free(r);
+		return;
+	}
+	pthread_detach(t);
+}
+#endif
+#endif
@@ -0,0 +1,162 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Hardware performance counters for the calling thread (Linux perf_event_open).
+
+ int perfctr_open(struct perfctr *p);   counters that opened, 0 if none
+ void perfctr_start(struct perfctr *p); zero and start them
+ void perfctr_stop(struct perfctr *p);  stop and read them into p->v
+ void perfctr_print(FILE *f, struct perfctr *p, char *m, double ops);
+	one line: m, then each counter divided by ops, or nothing if
+	no counter opened
+ void perfctr_close(struct perfctr *p);  the values stay for perfctr_print
+
+Counts cycles, instructions, branch misses, L1 data cache read misses and
+last level cache misses, user space only so perf_event_paranoid 2 is enough.
+Any other event can be added by setting PERFCTR_RAW to a list of name=config
+pairs with the hex raw event code of the CPU (an entry that is not name=hex
+is reported and skipped), for example cross-core snoops
+that hit a modified line on recent Intel parts:
+	PERFCTR_RAW=hitm=0x04d2,offcore=0x01b7 ./owq_test
+Each counter is opened on its own so the ones the machine does not have (a
+container, a VM without a PMU, an unknown raw code) are skipped and the rest
+still count. If the kernel multiplexes counters the values are scaled by
+time enabled over time running. Every call is a no-op once perfctr_open has
+found nothing, so a program can call them unconditionally and run anywhere.
+Set PERFCTR=0 to turn them off.
+*/
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERFCTR_MAX 12
+#define PERFCTR_RAWNAME 16
+
+struct perfctr {
+	int n;
+	int fd[PERFCTR_MAX];
+	char *name[PERFCTR_MAX];
+	char raw[PERFCTR_MAX][PERFCTR_RAWNAME];
+	double v[PERFCTR_MAX];
+};
+
+static inline int perfctr_add(struct perfctr *p, char *name, uint32_t type, uint64_t config)
+{
+	struct perf_event_attr a;
+	int fd;
+
+	if (p->n >= PERFCTR_MAX)
+		return -1;
+	memset(&a, 0, sizeof(a));
+	a.size = sizeof(a);
+	a.type = type;
+	a.config = config;
+	a.disabled = 1;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fd = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);	//this thread, any cpu
+	if (fd < 0)
+		return -1;
+	p->fd[p->n] = fd;
+	p->name[p->n++] = name;
+	return 0;
+}
+
+#define PERFCTR_CACHE(c, op, r) ((c) | (op) << 8 | (r) << 16)
+
+static inline int perfctr_open(struct perfctr *p)
+{
+	char *e = getenv("PERFCTR"), *raw = getenv("PERFCTR_RAW");
+
+	memset(p, 0, sizeof(struct perfctr));
+	if (e && !strcmp(e, "0"))
+		return 0;
+	perfctr_add(p, "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	perfctr_add(p, "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	perfctr_add(p, "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	perfctr_add(p, "L1d-misses", PERF_TYPE_HW_CACHE,
+		    PERFCTR_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+				  PERF_COUNT_HW_CACHE_RESULT_MISS));
+	perfctr_add(p, "LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	while (raw && *raw && p->n < PERFCTR_MAX) {	//name=config,...
+		char *comma = strchr(raw, ','), *eq, *end = raw;
+		int k = p->n, len;
+		uint64_t config = 0;
+
+		if (!comma)
+			comma = raw + strlen(raw);
+		eq = memchr(raw, '=', comma - raw);
+		if (eq)
+			config = strtoull(eq + 1, &end, 16);
+		len = (eq ? eq : comma) - raw;
+		len = len < PERFCTR_RAWNAME - 1 ? len : PERFCTR_RAWNAME - 1;
+		memcpy(p->raw[k], raw, len);
+		p->raw[k][len] = 0;
+		if (!eq || end == eq + 1 || end != comma)
+			fprintf(stderr, "perfctr: bad raw event %.*s, want name=hex config\n", (int)(comma - raw), raw);
+		else if (perfctr_add(p, p->raw[k], PERF_TYPE_RAW, config) < 0)
+			fprintf(stderr, "perfctr: can't count raw event %s\n", p->raw[k]);
+		raw = *comma ? comma + 1 : comma;
+	}
+	return p->n;
+}
+
+static inline void perfctr_start(struct perfctr *p)
+{
+	int i;
+
+	for (i = 0; i < p->n; i++) {
+		ioctl(p->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(p->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static inline void perfctr_stop(struct perfctr *p)
+{
+	uint64_t r[3];		//value, time enabled, time running
+	int i;
+
+	for (i = 0; i < p->n; i++)
+		ioctl(p->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+	for (i = 0; i < p->n; i++) {
+		if (read(p->fd[i], r, sizeof(r)) != sizeof(r) || !r[2])
+			p->v[i] = 0;
+		else
+			p->v[i] = (double)r[0] * r[1] / r[2];
+	}
+}
+
+static inline void perfctr_print(FILE *f, struct perfctr *p, char *m, double ops)
+{
+	int i;
+
+	if (!p->n || ops <= 0)
+		return;
+	fprintf(f, "  %s per op:", m);
+	for (i = 0; i < p->n; i++)
+		fprintf(f, " %s %.3f", p->name[i], p->v[i] / ops);
+	fprintf(f, "\n");
+}
+
+static inline void perfctr_close(struct perfctr *p)
+{
+	int i;
+
+	for (i = 0; i < p->n; i++)
+		close(p->fd[i]);
+}
+#endif
@@ -0,0 +1,266 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Small object allocator with per-thread caches.
+
+ void *smalloc(size_t n, char *message);  like mmalloc: exits on failure
+ void sfree(void *p);
+
+Requests up to 2048 bytes are rounded up to one of SM_CLASSES power of 2
+size classes and served from a free list private to the calling thread, so
+the common case takes no locks and touches no shared cache lines.
+Larger requests go straight to malloc.
+
+Every block has a 16 byte header recording the size class and the id of
+the thread that owns it. A block freed by its owner goes back on the owner's
+free list. A block freed by some other thread is pushed on a one-way-queue
+(owq.h) that runs from the freeing thread to the owner - one queue for each
+(owner, freer) pair, so each queue has exactly one producer and one consumer
+which is what owq needs. The owner drains its queues when one of its free
+lists runs dry. If a return queue is full the block goes on a mutex protected
+overflow list in the owner - that should be rare.
+
+This is made for the producer/consumer pattern where one thread allocates
+buffers, passes them through an owq, and the consumer frees them: the
+buffers flow back to the producer in batches without any lock.
+
+Memory is never given back to the system - free lists only grow to the high
+water mark. Thread ids are recycled: when a thread exits its cache is
+parked and the next new thread adopts it, with all the free blocks in it.
+At most SM_MAXTHREADS threads can use the allocator at the same time.
+
+Like the other headers, everything is static so use it from one source file.
+The owq functions are included under the names sm_owq_* so a program can
+still include owq.h for its own element type.
+See smalloc_test.c for a benchmark against malloc/free.
+*/
+#ifndef SMALLOC_H
+#define SMALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mmalloc.h"
+
+#define owq_element_t void *
+#define owq_struct sm_owq_struct
+#define owq_enq sm_owq_enq
+#define owq_deq sm_owq_deq
+#include "owq.h"
+#undef owq_element_t
+#undef owq_struct
+#undef owq_enq
+#undef owq_deq
+
+#ifndef SM_MAXTHREADS
+#define SM_MAXTHREADS 16
+#endif
+#ifndef SM_CHUNK
+#define SM_CHUNK (64*1024)	//refill size for an empty free list
+#endif
+#ifndef SM_RQSIZE
+#define SM_RQSIZE 4096		//slots in each cross thread return queue
+#endif
+#define SM_CLASSES 8		//16,32, ... 2048
+#define SM_MINSHIFT 4		//smallest class is 1<<SM_MINSHIFT
+#define SM_HDR 16		//keeps the payload 16 byte aligned
+#define SM_LARGE 0xffff		//class of a block from plain mmalloc
+
+struct sm_hdr {
+	unsigned short owner;
+	unsigned short cls;
+};
+
+// free blocks are linked through their first word
+struct sm_cache {
+	unsigned int id;
+	void *free[SM_CLASSES];
+	// rq[j] carries blocks we own that thread j freed - j creates it
+	struct sm_owq_struct *rq[SM_MAXTHREADS];
+	pthread_mutex_t lock;	//protects ovf
+	void *ovf;
+	struct sm_cache *parked;
+};
+
+static struct sm_cache *sm_caches[SM_MAXTHREADS];
+static unsigned int sm_nthreads;
+static struct sm_cache *sm_parked;	//caches of exited threads
+static pthread_mutex_t sm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sm_key;
+static pthread_once_t sm_once = PTHREAD_ONCE_INIT;
+static __thread struct sm_cache *sm_self;
+
+static inline struct sm_hdr *sm_hdr(void *p)
+{
+	return (struct sm_hdr *)((char *)p - SM_HDR);
+}
+
+static inline unsigned int sm_class(size_t n)
+{
+	if (n <= (1 << SM_MINSHIFT))
+		return 0;
+	return (sizeof(long) * 8 - __builtin_clzl(n - 1)) - SM_MINSHIFT;
+}
+
+static inline void sm_push(struct sm_cache *c, void *p)
+{
+	unsigned int cls = sm_hdr(p)->cls;
+	*(void **)p = c->free[cls];
+	c->free[cls] = p;
+}
+
+static void sm_exit(void *v)
+{
+	struct sm_cache *c = (struct sm_cache *)v;
+	pthread_mutex_lock(&sm_lock);
+	c->parked = sm_parked;
+	sm_parked = c;
+	pthread_mutex_unlock(&sm_lock);
+}
+
+static void sm_makekey(void)
+{
+	pthread_key_create(&sm_key, sm_exit);
+}
+
+static struct sm_cache *sm_register(void)
+{
+	struct sm_cache *c;
+
+	pthread_once(&sm_once, sm_makekey);
+	pthread_mutex_lock(&sm_lock);
+	if ((c = sm_parked)) {
+		sm_parked = c->parked;
+	} else if (sm_nthreads < SM_MAXTHREADS) {
+		c = (struct sm_cache *)mmalloc(sizeof(struct sm_cache),
+					       "smalloc thread cache");
+		memset(c, 0, sizeof(struct sm_cache));
+		c->id = sm_nthreads;
+		pthread_mutex_init(&c->lock, NULL);
+		__atomic_store_n(&sm_caches[c->id], c, __ATOMIC_RELEASE);
+		__atomic_store_n(&sm_nthreads, sm_nthreads + 1,
+				 __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sm_lock);
+	if (!c) {
+		fprintf(stderr, "FAIL SMALLOC: more than %d threads\n",
+			SM_MAXTHREADS);
+		exit(-1);
+	}
+	pthread_setspecific(sm_key, c);
+	sm_self = c;
+	return c;
+}
+
+// pull back everything other threads have freed for us
+static void sm_drain(struct sm_cache *c)
+{
+	unsigned int j, n = __atomic_load_n(&sm_nthreads, __ATOMIC_ACQUIRE);
+	void *p;
+
+	for (j = 0; j < n; j++) {
+		struct sm_owq_struct *q =
+		    __atomic_load_n(&c->rq[j], __ATOMIC_ACQUIRE);
+		if (!q)
+			continue;
+		while (sm_owq_deq(q, &p) == 0)
+			sm_push(c, p);
+	}
+	if (__atomic_load_n(&c->ovf, __ATOMIC_RELAXED)) {
+		void *next;
+		pthread_mutex_lock(&c->lock);
+		p = c->ovf;
+		c->ovf = NULL;
+		pthread_mutex_unlock(&c->lock);
+		for (; p; p = next) {
+			next = *(void **)p;
+			sm_push(c, p);
+		}
+	}
+}
+
+static void *sm_refill(struct sm_cache *c, unsigned int cls)
+{
+	unsigned int bs = SM_HDR + (1 << (cls + SM_MINSHIFT));
+	char *chunk;
+	unsigned int i;
+
+	sm_drain(c);
+	if (c->free[cls])
+		return c->free[cls];
+	chunk = mmalloc(SM_CHUNK, "smalloc chunk");
+	for (i = 0; i + bs <= SM_CHUNK; i += bs) {
+		struct sm_hdr *h = (struct sm_hdr *)(chunk + i);
+		h->owner = c->id;
+		h->cls = cls;
+		sm_push(c, chunk + i + SM_HDR);
+	}
+	return c->free[cls];
+}
+
+static void sm_return(struct sm_cache *c, unsigned int owner, void *p)
+{
+	struct sm_cache *o = __atomic_load_n(&sm_caches[owner],
+					     __ATOMIC_ACQUIRE);
+	struct sm_owq_struct *q = o->rq[c->id];
+
+	if (!q) {
+		q = (struct sm_owq_struct *)
+		    mmalloc(sizeof(struct sm_owq_struct) +
+			    SM_RQSIZE * sizeof(void *), "smalloc return queue");
+		q->h = q->t = 0;
+		q->v = (void **)(q + 1);
+		q->z = SM_RQSIZE;
+		__atomic_store_n(&o->rq[c->id], q, __ATOMIC_RELEASE);
+	}
+	if (sm_owq_enq(q, p) == 0)
+		return;
+	pthread_mutex_lock(&o->lock);
+	*(void **)p = o->ovf;
+	o->ovf = p;
+	pthread_mutex_unlock(&o->lock);
+}
+
+static inline void *smalloc(size_t n, char *message)
+{
+	struct sm_cache *c = sm_self ? sm_self : sm_register();
+	unsigned int cls = sm_class(n);
+	void *p;
+
+	if (cls >= SM_CLASSES) {
+		struct sm_hdr *h = (struct sm_hdr *)mmalloc(n + SM_HDR, message);
+		h->owner = c->id;
+		h->cls = SM_LARGE;
+		return (char *)h + SM_HDR;
+	}
+	if (!(p = c->free[cls]))
+		p = sm_refill(c, cls);
+	c->free[cls] = *(void **)p;
+	return p;
+}
+
+static inline void sfree(void *p)
+{
+	struct sm_cache *c;
+	struct sm_hdr *h;
+
+	if (!p)
+		return;
+	h = sm_hdr(p);
+	if (h->cls == SM_LARGE) {
+		mfree(h);
+		return;
+	}
+	c = sm_self ? sm_self : sm_register();
+	if (h->owner == c->id)
+		sm_push(c, p);
+	else
+		sm_return(c, h->owner, p);
+}
+#endif
@@ -0,0 +1,177 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Vectorized word splitting.
+
+ int wordsplit(unsigned char *b, size_t n, size_t *at, int eof,
+		struct wordslice *v, int max);
+ int wordsplit_scalar(...same...);
+
+Scans b[*at .. n) and stores up to max words in v as (pointer, length).
+A word starts at a letter and runs up to the next white space - the same
+rule as isalpha/isspace in the C locale, which markov.c has always used.
+On return *at is where the next scan should start. If the data ends in the
+middle of a word that word is only returned when eof is set, otherwise *at
+is left at its first letter so the caller can read more and scan again.
+
+The bytes are classified 64 at a time into two bit masks (letters, white
+space) using SSE2 compares - AVX2 if compiled with -mavx2 or -march=native.
+Then word boundaries are found with count-trailing-zeros on the masks, so
+the work is per word instead of per byte with a test and branch on each
+character. wordsplit_scalar builds the same masks one byte at a time, for
+other processors and for comparison. See wordsplit_test.c.
+*/
+#ifndef WORDSPLIT_H
+#define WORDSPLIT_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+struct wordslice {
+	unsigned char *w;
+	int len;
+};
+
+#define WS_BLOCK 64
+
+static inline void ws_masks_scalar(const unsigned char *p, uint64_t *a, uint64_t *s)
+{
+	uint64_t x = 0, y = 0;
+	int i;
+
+	for (i = 0; i < WS_BLOCK; i++) {
+		unsigned int c = p[i];
+		x |= (uint64_t)(((c | 0x20) - 'a') < 26) << i;
+		y |= (uint64_t)(c == ' ' || (c - 9) < 5) << i;
+	}
+	*a = x;
+	*s = y;
+}
+
+#if defined(__AVX2__)
+static inline void ws_masks_simd(const unsigned char *p, uint64_t *a, uint64_t *s)
+{
+	const __m256i x20 = _mm256_set1_epi8(0x20), ca = _mm256_set1_epi8('a');
+	const __m256i c25 = _mm256_set1_epi8(25), c9 = _mm256_set1_epi8(9);
+	const __m256i c4 = _mm256_set1_epi8(4), sp = _mm256_set1_epi8(' ');
+	uint64_t x = 0, y = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+		// letter: (c|0x20)-'a' <= 25 unsigned, space: c-9 <= 4 or ' '
+		__m256i t = _mm256_sub_epi8(_mm256_or_si256(c, x20), ca);
+		__m256i u = _mm256_sub_epi8(c, c9);
+		__m256i isa = _mm256_cmpeq_epi8(_mm256_min_epu8(t, c25), t);
+		__m256i iss = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(u, c4), u),
+					      _mm256_cmpeq_epi8(c, sp));
+		x |= (uint64_t)(uint32_t)_mm256_movemask_epi8(isa) << (32 * i);
+		y |= (uint64_t)(uint32_t)_mm256_movemask_epi8(iss) << (32 * i);
+	}
+	*a = x;
+	*s = y;
+}
+#define WS_SIMD 1
+#elif defined(__SSE2__)
+static inline void ws_masks_simd(const unsigned char *p, uint64_t *a, uint64_t *s)
+{
+	const __m128i x20 = _mm_set1_epi8(0x20), ca = _mm_set1_epi8('a');
+	const __m128i c25 = _mm_set1_epi8(25), c9 = _mm_set1_epi8(9);
+	const __m128i c4 = _mm_set1_epi8(4), sp = _mm_set1_epi8(' ');
+	uint64_t x = 0, y = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+		// letter: (c|0x20)-'a' <= 25 unsigned, space: c-9 <= 4 or ' '
+		__m128i t = _mm_sub_epi8(_mm_or_si128(c, x20), ca);
+		__m128i u = _mm_sub_epi8(c, c9);
+		__m128i isa = _mm_cmpeq_epi8(_mm_min_epu8(t, c25), t);
+		__m128i iss = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(u, c4), u),
+					   _mm_cmpeq_epi8(c, sp));
+		x |= (uint64_t)(uint16_t)_mm_movemask_epi8(isa) << (16 * i);
+		y |= (uint64_t)(uint16_t)_mm_movemask_epi8(iss) << (16 * i);
+	}
+	*a = x;
+	*s = y;
+}
+#define WS_SIMD 1
+#else
+#define ws_masks_simd ws_masks_scalar
+#define WS_SIMD 0
+#endif
+
+static inline __attribute__((always_inline))
+int ws_split(unsigned char *b, size_t n, size_t *at, int eof,
+	     struct wordslice *v, int max, int simd)
+{
+	size_t base = *at, start = 0;
+	int inword = 0, k = 0;
+	uint64_t a, s, m;
+	unsigned int cur;
+
+	for (; base < n; base += WS_BLOCK) {
+		if (n - base >= WS_BLOCK) {
+			if (simd)
+				ws_masks_simd(b + base, &a, &s);
+			else
+				ws_masks_scalar(b + base, &a, &s);
+		} else {	//the tail: zero bytes are neither letters nor space
+			unsigned char tail[WS_BLOCK] = { 0 };
+			memcpy(tail, b + base, n - base);
+			ws_masks_scalar(tail, &a, &s);
+		}
+		cur = 0;
+		for (;;) {
+			if (!inword) {
+				if (!(m = a >> cur << cur))
+					break;
+				cur = __builtin_ctzll(m);
+				start = base + cur;
+				inword = 1;
+			}
+			if (!(m = s >> cur << cur))
+				break;
+			cur = __builtin_ctzll(m);
+			v[k].w = b + start;
+			v[k].len = base + cur - start;
+			inword = 0;
+			if (++k == max) {
+				*at = base + cur;
+				return k;
+			}
+		}
+	}
+	if (inword && !eof) {
+		*at = start;
+		return k;
+	}
+	if (inword) {
+		v[k].w = b + start;
+		v[k].len = n - start;
+		k++;
+	}
+	*at = n;
+	return k;
+}
+
+static inline int wordsplit(unsigned char *b, size_t n, size_t *at, int eof,
+			    struct wordslice *v, int max)
+{
+	return ws_split(b, n, at, eof, v, max, WS_SIMD);
+}
+
+static inline int wordsplit_scalar(unsigned char *b, size_t n, size_t *at,
+				   int eof, struct wordslice *v, int max)
+{
+	return ws_split(b, n, at, eof, v, max, 0);
+}
+#endif
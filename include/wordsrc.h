@@ -0,0 +1,167 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Zero copy word source.
+
+ int wordsrc_open(struct wordsrc *s, int fd);  0 on success, -1 on fail
+ int wordsrc_next(struct wordsrc *s, unsigned char **w, int *len);
+	1 and a word in (*w,*len), or 0 at the end of the input
+ int wordsrc_batch(struct wordsrc *s, struct wordslice *v, int max);
+	fills v with up to max words using wordsplit.h and returns the count,
+	0 at the end of the input
+ void wordsrc_close(struct wordsrc *s);
+
+A word starts at a letter and runs up to the next white space.
+Words are handed out as (pointer, length) slices into the input - they
+are not copied and not 0 terminated.
+
+If fd is a regular file the whole thing is mapped with one mmap and the
+slices stay good until wordsrc_close. Otherwise (a pipe or a terminal)
+the input is read into one large buffer that is reused: when a word runs
+off the end of the data, the start of the word is moved to the front of
+the buffer and whatever has arrived is read in behind it, so no word is
+ever split and words from a slow pipe come out as soon as they are there.
+The buffer doubles if a single word is bigger than the buffer.
+For streams a slice is only good until the next wordsrc_next or
+wordsrc_batch call - check
+s->stable, which is 1 for mapped input.
+*/
+#ifndef WORDSRC_H
+#define WORDSRC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mmalloc.h"
+#include "wordsplit.h"
+
+#ifndef WORDSRC_BUFSIZE
+#define WORDSRC_BUFSIZE (1024*1024)	//read buffer for pipes
+#endif
+
+struct wordsrc {
+	unsigned char *buf;
+	size_t n;		//valid bytes in buf
+	size_t next;		//scan position
+	size_t size;		//size of buf for streams
+	int fd;
+	int eof;
+	int stable;		//1 if slices last until close (mmap)
+};
+
+static inline int wordsrc_open(struct wordsrc *s, int fd)
+{
+	struct stat st;
+
+	s->fd = fd;
+	s->next = s->n = 0;
+	s->eof = 0;
+	s->stable = 0;
+	s->buf = NULL;
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			s->buf = (unsigned char *)m;
+			s->n = s->size = st.st_size;
+			s->eof = 1;
+			s->stable = 1;
+			return 0;
+		}
+	}
+	s->size = WORDSRC_BUFSIZE;
+	s->buf = (unsigned char *)mmalloc(s->size, "word source buffer");
+	return 0;
+}
+
+// keep bytes from keep on, refill the rest of the buffer
+// returns how far data moved down
+static inline size_t wordsrc_fill(struct wordsrc *s, size_t keep)
+{
+	ssize_t r;
+
+	if (keep == 0 && s->n == s->size) {	//one huge word
+		unsigned char *b = (unsigned char *)mmalloc(2 * s->size,
+							  "word source buffer");
+		memcpy(b, s->buf, s->n);
+		mfree(s->buf);
+		s->buf = b;
+		s->size *= 2;
+	} else if (keep) {
+		memmove(s->buf, s->buf + keep, s->n - keep);
+		s->n -= keep;
+	}
+	//one read: a slow stream is handed out as it comes, not when the buffer is full
+	r = read(s->fd, s->buf + s->n, s->size - s->n);
+	if (r <= 0)
+		s->eof = 1;
+	else
+		s->n += r;
+	return keep;
+}
+
+static inline int wordsrc_next(struct wordsrc *s, unsigned char **w, int *len)
+{
+	size_t i = s->next, j;
+
+	for (;;) {
+		while (i < s->n && !isalpha(s->buf[i]))
+			i++;
+		if (i < s->n)
+			break;
+		if (s->eof)
+			return 0;
+		wordsrc_fill(s, s->n);
+		i = 0;
+	}
+	for (j = i;;) {
+		while (j < s->n && !isspace(s->buf[j]))
+			j++;
+		if (j < s->n || s->eof)
+			break;
+		//the word runs off the end of the data
+		j -= wordsrc_fill(s, i);
+		i = 0;
+	}
+	*w = s->buf + i;
+	*len = j - i;
+	s->next = j;
+	return 1;
+}
+
+static inline int wordsrc_batch(struct wordsrc *s, struct wordslice *v, int max)
+{
+	int k;
+
+	for (;;) {
+		size_t at = s->next;
+		k = wordsplit(s->buf, s->n, &at, s->eof, v, max);
+		s->next = at;
+		if (k || s->eof)
+			return k;
+		//nothing complete left in the buffer
+		wordsrc_fill(s, at);
+		s->next = 0;
+	}
+}
+
+static inline void wordsrc_close(struct wordsrc *s)
+{
+	if (s->stable)
+		munmap(s->buf, s->size);
+	else
+		mfree(s->buf);
+	s->buf = NULL;
+}
+#endif
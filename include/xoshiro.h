@@ -0,0 +1,69 @@
+/*
+ xoshiro256** pseudo random numbers (Blackman and Vigna, public domain
+ algorithm) with splitmix64 seeding. Each user keeps its own state so
+ there is no shared lock like the one inside random().
+
+ void xo_seed(struct xoshiro *r, uint64_t seed, uint64_t stream);
+	streams with the same seed are independent sequences - use one
+	per thread or per job to get results that do not depend on scheduling
+ uint64_t xo_next(struct xoshiro *r);
+ uint32_t xo_below(struct xoshiro *r, uint32_t n);   0 .. n-1, n > 0
+ double xo_double(struct xoshiro *r);                 [0,1)
+*/
+#ifndef XOSHIRO_H
+#define XOSHIRO_H
+
+#include <stdint.h>
+
+struct xoshiro {
+	uint64_t s[4];
+};
+
+static inline uint64_t xo_splitmix(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9E3779B97F4A7C15UL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+	return z ^ (z >> 31);
+}
+
+static inline void xo_seed(struct xoshiro *r, uint64_t seed, uint64_t stream)
+{
+	uint64_t x = seed ^ xo_splitmix(&stream);
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r->s[i] = xo_splitmix(&x);
+}
+
+static inline uint64_t xo_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xo_next(struct xoshiro *r)
+{
+	uint64_t *s = r->s;
+	uint64_t result = xo_rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = xo_rotl(s[3], 45);
+	return result;
+}
+
+// multiply and shift instead of %, the bias is at most n/2^32
+static inline uint32_t xo_below(struct xoshiro *r, uint32_t n)
+{
+	return (uint32_t)(((xo_next(r) >> 32) * (uint64_t)n) >> 32);
+}
+
+static inline double xo_double(struct xoshiro *r)
+{
+	return (xo_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+#endif
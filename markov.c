@@ -1,7 +1,24 @@
 /*
  * Markov text generator.
  *
- *  use:  markov < input.txt 
+ *  use:  markov [-k order] [-j threads] [-n words] [-b samples] [-s seed] [-v] [-o model] [input.txt]
+ *        markov -u words [-M megabytes] [-k order] [-j threads] [-n words] [-b samples] [-s seed] [-v] [-o model] [input]
+ *        markov -m model [-V] [-j threads] [-n words] [-b samples] [-s seed] [-v]
+ *     or  cat *.txt | markov
+ *
+ *  -k  how many words of context choose the next word, 1 to MAXORDER (default 2)
+ *  -j  build the dictionary, and write samples, with this many threads, 1 to MAXTHREADS
+ *      (to build in parallel the input must be a regular file). Giving the words,
+ *      contexts and states their merged ids is done by one thread, about 1/8 of the
+ *      one thread build time, so that is as far as the build speeds up; -v times it
+ *  -n  how many words to write (default WORD_COUNT), or per sample with -b
+ *  -b  write this many independent samples, one per line
+ *  -s  random seed, default is the time
+ *  -v  print statistics and timing to stderr
+ *  -u  train online: publish a new model every this many words while -j threads serve
+ *      the -b samples from whatever model is current, see Train_Online
+ *  -M  with -u, keep the training memory under this many megabytes more than the
+ *      starting tables (about 1 MB) by decaying counts
  *
  * This is a C language rewrite of the Lua book Markov program ( Roberto Ierusalimschy).
  * Only 3x as many lines of code but written for the serious purpose of, no serious purpose.
@@ -9,204 +26,1875 @@
  * reads text files from standard input and writes text using the vocabulary and probabilities
  * learned from the text.
  *
- * The program depends on C generic double linked list functions using sed to adapt them to
- * different types (the sed commands are in the Makefile).
+ * Build a dictionary of the unique runs of order words (states) that appear in the text and
+ * associate each entry with the words that immediately follow that use of the state in the
+ * text and how many times each one did. The Lua program, and this one by default, uses
+ * order 2: pairs of words.
+ *
+ * Input comes from wordsrc.h: a regular file is mapped with mmap, anything else is read
+ * through one big reusable buffer, and words come back in batches as slices into that
+ * memory (the splitting is vectorized in wordsplit.h).
+ * Each distinct word is copied once into the word table (intern) and from then on
+ * it is just a number - its index in the table.
+ *
+ * Text generation starts with order "\n" words and randomly selects a follower w of
+ * that state, weighted by count, and prints it. The next state is the last order-1 words
+ * of the old one then w. Then it does it again, and so on.
  *
- * Build a dictionary of the unique pairs of words that appear in the text and associate
- * each entry with the list of words that immediately follow that use of that pair in the text 
- * (that list of followers may contain repetitions).
+ * Keys are the same size whatever the order. A context of k words is the 64 bit key
+ * (id of the context of its first k-1 words, id of its last word) in a flat open
+ * addressing table, and a state is (id of the context of its first order-1 words, last
+ * word) in another. So contexts are a tree of the distinct runs of up to order-1 words
+ * where every longer context and every state shares its prefix: a state costs the same
+ * at any order and only the context table grows with the order. Each state also keeps
+ * the id of the context of its last order-1 words, so moving on to the next state is
+ * one lookup of (that context, follower) - no need to rebuild keys word by word.
  *
- * Text generation starts somewhere with (w1,w2) and randomly selects an element w3 in the list
- * of followers for w2 to get (w2,w3) - printing w2. Then it does it again, this time printing
- * w2, selecting some w4 in the list of followers for w3 and so on. 
+ * Each state has an array of distinct followers with counts. While training a second hash
+ * table finds the array entry for a (state, follower) so adding one is constant time.
+ * When training is done the dictionary is frozen: each follower array is trimmed and
+ * gets a Walker alias table so picking a follower is two random numbers and one compare
+ * no matter how many followers there are.
  *
- * The dictionary is a hash table (using a hash algorithm attributed to Daniel J. Bernstein) where
- * each element is a linked list of colliding pairs and each element in that linked list has a linked
- * list of followers.
+ * With -j T the mapped input is cut into T chunks at white space and each thread
+ * builds a private dictionary for its chunk, starting from the last order words
+ * before the chunk so states that span the cut are counted. Then the word tables,
+ * contexts and states are merged in chunk order (so ids come out in order of first
+ * appearance, as in the one thread build) and T threads each merge the followers of
+ * one range of states, again taking the chunks in order. Every table, follower array
+ * and count ends up exactly as the one thread build makes it.
  */
 
 #define WORD_COUNT 500 //how many words to generate
-#define HLISTSIZE 10000 //size of the hash table used in hash.h- make it bigger for bigger inputs
-#define WORDSIZE 25		//max number of characters allowed per word
-#define CHARBUFSIZE 2048 //chunk size for reads of the input file
+#define MAXORDER 8 //longest context, -k
+#define MAXTHREADS 256 //-j
+#define HLISTSIZE 10000 //hash.h reduces its string hashes with this, markov does not use them
+#define WORDTABLESIZE 4096 //initial size of the word table, it grows as needed
+#define KEYTABLESIZE 4096 //initial size of the context and state tables, they grow
+#define WORDCHUNK (64*1024) //allocation unit for word text
+#define WORDBATCH 1024 //words per call to the tokenizer
+#define EDGETABLESIZE 65536 //initial size of the (state,follower) table, it grows
 
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
-#include <unistd.h> //more includes in the text below
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <mmalloc.h>
+#include <wordsrc.h>
+#include <xoshiro.h>
+#include "hash.h"
 
 struct dictionary;		//defined below
 
 struct dictionary *Build_Dictionary(int fd); //does what it says
-void Write_Markov(struct dictionary *d, int count); //this is the creative writer
+struct dictionary *Build_Dictionary_Parallel(int fd, int threads);
+void Dictionary_Stats(struct dictionary *d);
+unsigned long millisec(void);
+
+int verbose = 0;
+int order = 2;
+unsigned int seed;
+
+struct model;
+struct model *Compile_Model(struct dictionary *d);
+struct model *Load_Model(char *file, int check);
+void Save_Model(struct model *m, char *file);
+void Write_Markov(struct model *m, int count); //this is the creative writer
+void Write_Batch(struct model *m, int count, long samples, int threads);
+void Train_Online(int fd, long every, unsigned long budget, int count, long samples,
+		  int threads, char *save);
+static void run(int n, void *(*f)(void *), void *a, size_t z);
+static void model_free(struct model *m);
 
-int main()
+int main(int argc, char **argv)
 {
-	struct dictionary *d = Build_Dictionary(0);
-	if (d == NULL) {
-		fprintf(stderr, "Can't build dictionary\n");
-		exit(0);
+	struct dictionary *d;
+	struct model *m;
+	int fd = 0, c, threads = 1, count = WORD_COUNT, check = 0;
+	char *load = NULL, *save = NULL;
+	long samples = 0, every = 0;
+	unsigned long t, budget = 0;
+
+	seed = time(0);
+	while ((c = getopt(argc, argv, "j:n:s:vm:o:Vb:k:u:M:")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads >= 1 && threads <= MAXTHREADS)
+				break;
+			fprintf(stderr, "threads must be 1 to %d\n", MAXTHREADS);
+			exit(1);
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'm':
+			load = optarg;
+			break;
+		case 'o':
+			save = optarg;
+			break;
+		case 'V':
+			check = 1;
+			break;
+		case 'b':
+			samples = atol(optarg);
+			break;
+		case 'u':
+			every = atol(optarg);
+			break;
+		case 'M':
+			budget = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'k':
+			order = atoi(optarg);
+			if (order >= 1 && order <= MAXORDER)
+				break;
+			fprintf(stderr, "order must be 1 to %d\n", MAXORDER);
+			exit(1);
+		default:
+			fprintf(stderr, "use: markov [-k order] [-j threads] [-n words] [-b samples] [-s seed] [-v] [-o model] [file]\n"
+				"     markov -u words [-M megabytes] [-k order] [-j threads] [-n words] [-b samples] [-s seed] [-v] [-o model] [file]\n"
+				"     markov -m model [-V] [-j threads] [-n words] [-b samples] [-s seed] [-v]\n");
+			exit(1);
+		}
+	}
+	if (!load && optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+		fprintf(stderr, "Can't open %s\n", argv[optind]);
+		exit(1);
+	}
+	t = millisec();
+	if (every > 0 && !load) {
+		Train_Online(fd, every, budget, count, samples, threads, save);
+	} else {
+		if (load) {
+			if (!(m = Load_Model(load, check)))
+				exit(1);
+			if (verbose)
+				fprintf(stderr, "loaded model in %lu milliseconds\n", millisec() - t);
+		} else {
+			d = threads > 1 ? Build_Dictionary_Parallel(fd, threads) : Build_Dictionary(fd);
+			if (d == NULL) {
+				fprintf(stderr, "Can't build dictionary\n");
+				exit(0);
+			}
+			if (verbose) {
+				fprintf(stderr, "built order %d dictionary with %d thread%s in %lu milliseconds\n",
+					order, threads, threads > 1 ? "s" : "", millisec() - t);
+				Dictionary_Stats(d);
+			}
+			m = Compile_Model(d);
+		}
+		if (save)
+			Save_Model(m, save);
+		if (samples > 0)
+			Write_Batch(m, count, samples, threads);
+		else
+			Write_Markov(m, count);
+		model_free(m);
 	}
-	Write_Markov(d, WORD_COUNT);
+#ifdef MMALLOC_ACCOUNTING
+	fprintf(stderr, "\n");
+	mmalloc_dump(stderr);
+#endif
+	return 0;
 }
 
-//the linked lists need structures with n (next) and p (previous) pointers plus arbitrary payload
-struct pair;
 struct follow {
-	struct follow *n;
-	struct follow *p;
-	unsigned char *w;
+	unsigned int w;		//word id
+	unsigned int c;		//times it followed the state
 };
-struct pair {
-	struct pair *n;
-	struct pair *p;
-	unsigned char *w1, *w2;
-	int count;
-	struct follow *f;
-	int fcount;
+struct alias {			//Walker alias table entry, see freeze
+	unsigned int thresh;
+	unsigned int alias;
+};
+struct state {
+	uint32_t next;		//context of the last order-1 words, see step
+	uint32_t count;
+	struct follow *f;	//distinct followers
+	struct alias *a;	//NULL until frozen
+	unsigned int nf;	//how many in f
+	unsigned int fcap;	//room in f
+	unsigned int fcount;	//sum of the counts
 };
 
+// open addressing on 64 bit keys, ids are given out in order 0, 1, 2 ...
+struct keys {
+	uint32_t *t;		//id+1, 0 is empty
+	uint64_t size;
+	uint32_t count;
+	uint64_t *key;		//id -> key
+};
+#define NOKEY 0xffffffffU
+#define EMPTY 0xfffffffeU	//the context of no words
+#define KEY(c, w) ((uint64_t)(c) << 32 | (w))
+#define KEY_CTX(k) ((uint32_t)((k) >> 32))
+#define KEY_WORD(k) ((uint32_t)(k))
 
+// state 0 is the start, order "\n"s - it is always made first
 struct dictionary {
-	struct pair *H[HLISTSIZE];
+	struct keys ctx;	//contexts of 1 to order-1 words
+	struct keys st;		//states, order words
+	struct state *s;	//indexed by state id
+	uint32_t scap;		//room in s
 } thed;
 
-#define pair_t struct pair
-#include "pair_ll.h"
-struct pair *lookup(struct dictionary *d, unsigned char *, unsigned char *);
+// the word table: open addressing on ids of the distinct words
+struct words {
+	unsigned int *t;	//id+1, 0 is empty
+	unsigned int size;
+	unsigned int count;
+	unsigned char **w;	//id -> text
+	unsigned int *len;	//id -> length, words can have 0 bytes in them
+	unsigned char *text;	//free space for copies
+	int left;
+	unsigned char *chunks;	//list of text chunks, linked through the first word
+} thew;
+#define word(id) (thew.w[id])
+
+// (state, follower word) -> index in the state's follower array, only used in training
+struct edge {
+	uint32_t s;		//state id+1, 0 is empty
+	unsigned int w;
+	unsigned int i;
+};
+struct edges {
+	struct edge *t;
+	unsigned long size;
+	unsigned long count;
+	unsigned long fbytes;	//follower array space it has added
+} thee;
 
-unsigned char *getword(int);
-struct pair *add_pair(struct dictionary *, unsigned char *, unsigned char *);
-void add_follower(struct pair *, unsigned char *);
+unsigned int intern(struct words *, unsigned char *, int);
+void words_free(struct words *);
+unsigned int newline; //the id of "\n" which marks the start
+static uint32_t step(struct dictionary *, uint32_t *, uint32_t, unsigned int);
+static void window(struct dictionary *, uint32_t *, uint32_t *);
+void add_follower(struct edges *, struct dictionary *, uint32_t, unsigned int, unsigned int);
+void freeze(struct dictionary *, uint32_t, uint32_t);
 struct dictionary *Build_Dictionary(int fd)
 {
-	unsigned char *w;
-	struct pair *l = add_pair(&thed, (unsigned char *)"\n",(unsigned char *) "\n");
+	struct wordsrc in;
+	struct wordslice v[WORDBATCH];
+	uint32_t c[MAXORDER], start[MAXORDER], s;
+	int i, k;
 
-	while (l && (w = getword(fd))) {
-		add_follower(l, w);
-		l = add_pair(&thed, l->w2, w);
+	if (wordsrc_open(&in, fd) < 0)
+		return NULL;
+	newline = intern(&thew, (unsigned char *)"\n", 1);
+	for (i = 0; i < order; i++)
+		start[i] = newline;
+	window(&thed, c, start);
+	s = step(&thed, c, newline, 1);
+	while ((k = wordsrc_batch(&in, v, WORDBATCH))) {
+		for (i = 0; i < k; i++) {
+			unsigned int w = intern(&thew, v[i].w, v[i].len);
+			add_follower(&thee, &thed, s, w, 1);
+			s = step(&thed, c, w, 1);
+		}
 	}
+	wordsrc_close(&in);
+	freeze(&thed, 0, thed.st.count);
+	mfree(thee.t);
+	memset(&thee, 0, sizeof(struct edges));
 	return &thed;
 
 }
 
-unsigned char *follower(struct follow *, int);
-#include "hash.h"
-struct pair *lookup(struct dictionary *d, unsigned char *w1, unsigned char *w2)
+static void keys_grow(struct keys *x)
+{
+	uint64_t i, j, size = x->size ? 2 * x->size : KEYTABLESIZE;
+	uint32_t *t = (uint32_t *)mmalloc(size * sizeof(uint32_t), "key table");
+	uint64_t *key = (uint64_t *)mmalloc(size / 2 * sizeof(uint64_t), "key table");
+
+	memset(t, 0, size * sizeof(uint32_t));
+	for (i = 0; i < x->count; i++) {
+		j = hashkey(x->key[i]) & (size - 1);
+		while (t[j])
+			j = (j + 1) & (size - 1);
+		t[j] = i + 1;
+		key[i] = x->key[i];
+	}
+	mfree(x->t);
+	mfree(x->key);
+	x->t = t;
+	x->key = key;
+	x->size = size;
+}
+
+// the id of key k, a new one if it is not there
+static inline uint32_t key_add(struct keys *x, uint64_t k)
+{
+	uint64_t j;
+	uint32_t i;
+
+	if (2 * ((uint64_t)x->count + 1) > x->size)
+		keys_grow(x);
+	for (j = hashkey(k) & (x->size - 1); (i = x->t[j]); j = (j + 1) & (x->size - 1))
+		if (x->key[i - 1] == k)
+			return i - 1;
+	x->key[x->count] = k;
+	x->t[j] = ++x->count;
+	return x->count - 1;
+}
+
+// the id of key k, NOKEY if it is not there
+static inline uint32_t key_find(struct keys *x, uint64_t k)
+{
+	uint64_t j;
+	uint32_t i;
+
+	if (!x->size)
+		return NOKEY;
+	for (j = hashkey(k) & (x->size - 1); (i = x->t[j]); j = (j + 1) & (x->size - 1))
+		if (x->key[i - 1] == k)
+			return i - 1;
+	return NOKEY;
+}
+
+static void keys_free(struct keys *x)
+{
+	mfree(x->t);
+	mfree(x->key);
+	memset(x, 0, sizeof(struct keys));
+}
+
+static inline uint32_t add_ctx(struct dictionary *d, uint32_t c, uint32_t w)
+{
+	return key_add(&d->ctx, KEY(c, w));
+}
+
+// the state (context c, word w) with count more, new ones start at 0
+static uint32_t add_state(struct dictionary *d, uint32_t c, uint32_t w, unsigned int count)
+{
+	uint32_t n = d->st.count, i = key_add(&d->st, KEY(c, w));
+
+	if (d->st.count > n) {
+		if (i == d->scap) {
+			struct state *s;
+			d->scap = d->scap ? 2 * d->scap : KEYTABLESIZE / 2;
+			s = (struct state *)mmalloc(d->scap * sizeof(struct state), "states");
+			if (i)
+				memcpy(s, d->s, i * sizeof(struct state));
+			mfree(d->s);
+			d->s = s;
+		}
+		memset(&d->s[i], 0, sizeof(struct state));
+	}
+	d->s[i].count += count;
+	return i;
+}
+
+/*
+ * c[k] is the context of the last k words, c[0] is EMPTY. Word w ends the state
+ * (c[order-1], w) and then each c[k] becomes (c[k-1], w), longest first so c[k-1]
+ * is still the old one. Returns the state.
+ */
+static uint32_t step(struct dictionary *d, uint32_t *c, uint32_t w, unsigned int count)
+{
+	uint32_t s = add_state(d, c[order - 1], w, count);
+	int k;
+
+	for (k = order - 1; k > 0; k--)
+		c[k] = add_ctx(d, c[k - 1], w);
+	d->s[s].next = c[order - 1];
+	return s;
+}
+
+// set up c from the order-1 words in v with nothing known before them
+static void window(struct dictionary *d, uint32_t *c, uint32_t *v)
+{
+	int j, k;
+
+	c[0] = EMPTY;
+	for (j = 1; j < order; j++)
+		for (k = j; k > 0; k--)
+			c[k] = add_ctx(d, c[k - 1], v[j - 1]);
+}
+
+static inline unsigned long edge_hash(uint32_t s, unsigned int w, unsigned long size)
+{
+	unsigned long h = s * 0x9E3779B97F4A7C15UL ^ w * 0xC2B2AE3D27D4EB4FUL;
+	return (h ^ (h >> 31)) & (size - 1);
+}
+
+static void edges_grow(struct edges *e)
 {
+	unsigned long i, j, size = e->size ? 2 * e->size : EDGETABLESIZE;
+	struct edge *t = (struct edge *)mmalloc(size * sizeof(struct edge), "follower index");
+
+	memset(t, 0, size * sizeof(struct edge));
+	for (i = 0; i < e->size; i++) {
+		if (!e->t[i].s)
+			continue;
+		j = edge_hash(e->t[i].s, e->t[i].w, size);
+		while (t[j].s)
+			j = (j + 1) & (size - 1);
+		t[j] = e->t[i];
+	}
+	mfree(e->t);
+	e->t = t;
+	e->size = size;
+}
+
+// w follows state s another c times
+void add_follower(struct edges *x, struct dictionary *d, uint32_t s, unsigned int w, unsigned int c)
+{
+	struct state *p = &d->s[s];
+	unsigned long j;
+	struct edge *e;
+
+	if (2 * (x->count + 1) > x->size)
+		edges_grow(x);
+	p->fcount += c;
+	for (j = edge_hash(s + 1, w, x->size); (e = &x->t[j])->s; j = (j + 1) & (x->size - 1)) {
+		if (e->s == s + 1 && e->w == w) {
+			p->f[e->i].c += c;
+			return;
+		}
+	}
+	if (p->nf == p->fcap) {
+		struct follow *f;
+		x->fbytes += (p->fcap ? p->fcap : 2) * sizeof(struct follow);
+		p->fcap = p->fcap ? 2 * p->fcap : 2;
+		f = (struct follow *)mmalloc(p->fcap * sizeof(struct follow), "add follower");
+		if (p->nf)
+			memcpy(f, p->f, p->nf * sizeof(struct follow));
+		mfree(p->f);
+		p->f = f;
+	}
+	e->s = s + 1;
+	e->w = w;
+	e->i = p->nf;
+	x->count++;
+	p->f[p->nf].w = w;
+	p->f[p->nf++].c = c;
+}
 
-	struct pair *l= NULL;
-	int hindex = hash2strings(w1, w2);
-	struct pair **p = &d->H[hindex];
-	if (!(*p) || pair_isempty(p))
+/*
+ * Walker's alias method (Vose's version) in integers. Follower i has weight c[i]*nf
+ * and each of the nf slots holds fcount: slot j keeps its own follower with
+ * probability thresh/fcount and gives the rest to follower alias.
+ */
+static void make_alias(struct state *p, struct alias *a)
+{
+	unsigned int n = p->nf, i, s = 0, l = n;
+	unsigned long *w = (unsigned long *)mmalloc(n * sizeof(unsigned long), "alias work");
+	unsigned int *q = (unsigned int *)mmalloc(n * sizeof(unsigned int), "alias work");
+
+	for (i = 0; i < n; i++) {	//small ones from the front, large from the back
+		w[i] = (unsigned long)p->f[i].c * n;
+		if (w[i] < p->fcount)
+			q[s++] = i;
+		else
+			q[--l] = i;
+	}
+	while (s > 0 && l < n) {
+		unsigned int sm = q[--s], lg = q[l];
+		a[sm].thresh = w[sm];
+		a[sm].alias = lg;
+		w[lg] -= p->fcount - w[sm];
+		if (w[lg] < p->fcount) {	//large became small
+			l++;
+			q[s++] = lg;
+		}
+	}
+	while (l < n) {
+		a[q[l]].thresh = p->fcount;
+		a[q[l]].alias = q[l];
+		l++;
+	}
+	while (s > 0) {			//only rounding leaves these
+		a[q[--s]].thresh = p->fcount;
+		a[q[s]].alias = q[s];
+	}
+	mfree(w);
+	mfree(q);
+}
+
+// done training: trim the follower arrays and make alias tables for states lo..hi-1
+void freeze(struct dictionary *d, uint32_t lo, uint32_t hi)
+{
+	uint32_t i;
+
+	for (i = lo; i < hi; i++) {
+		struct state *l = &d->s[i];
+		if (!l->nf)
+			continue;
+		if (l->nf < l->fcap) {
+			struct follow *f = (struct follow *)mmalloc(l->nf * sizeof(struct follow), "add follower");
+			memcpy(f, l->f, l->nf * sizeof(struct follow));
+			mfree(l->f);
+			l->f = f;
+			l->fcap = l->nf;
+		}
+		l->a = (struct alias *)mmalloc(l->nf * sizeof(struct alias), "alias table");
+		make_alias(l, l->a);
+	}
+}
+
+/*
+ * The model: the frozen dictionary in one block of memory with no pointers in it,
+ * only offsets from the start, so it can be written to a file as is and mapped
+ * back in and used directly by any number of processes. Layout, 8 byte aligned:
+ *	header
+ *	words	nwords+1 offsets of word text (the last one is the end)
+ *	text	the words, each 0 terminated
+ *	table	tsize slots of state index+1 (0 is empty), open addressing on the key
+ *	states	nstates struct mstate
+ *	follow	nfollow struct follow, each state's followers together
+ *	alias	nfollow struct alias, same order
+ * The context table is not needed: every state has the context id that, with a
+ * follower, makes the key of the next state.
+ * The checksum is FNV-1a over everything after the header. It is not checked on
+ * every load (-V does it) since reading a big model would make startup slow,
+ * but the header has its own checksum which is, and every load checks that the
+ * sections fit in the file and the words, hash table, states, followers and alias
+ * tables only point inside them, so a damaged model is refused rather than
+ * crashing. Models are only good on machines with the same byte order as the one
+ * that wrote them.
+ */
+#define MODEL_MAGIC "MARKOV\0\0"
+#define MODEL_VERSION 2
+#define MODEL_BOM 0x01020304
+
+struct model_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t bom;		//byte order check
+	uint64_t size;		//of the whole model
+	uint64_t checksum;	//of everything after the header
+	uint64_t nwords, nstates, nfollow, tsize;
+	uint64_t words, text, table, states, follow, alias;	//offsets
+	uint32_t start;		//index of the order "\n"s state
+	uint32_t order;
+	uint64_t hcheck;	//of the header up to here
+};
+
+struct mstate {
+	uint64_t key;		//(context, last word)
+	uint32_t next;		//context for the next key
+	uint32_t count;
+	uint32_t nf;
+	uint32_t fcount;
+	uint64_t f;		//first follower
+};
+
+struct model {
+	struct model_header *h;
+	uint64_t *words;
+	char *text;
+	uint32_t *table;
+	struct mstate *states;
+	struct follow *f;
+	struct alias *a;
+	int mapped;
+	struct model *next;	//retired list, see publish
+};
+
+static uint64_t fnv(void *v, size_t n)
+{
+	unsigned char *b = (unsigned char *)v;
+	uint64_t sum = 1469598103934665603UL;
+	while (n--)
+		sum = (sum ^ *b++) * 1099511628211UL;
+	return sum;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+#define model_word(m, id) ((m)->text + (m)->words[id])
+
+uint32_t model_lookup(struct model *m, uint32_t c, uint32_t w)
+{
+	uint64_t k = KEY(c, w), j = hashkey(k) & (m->h->tsize - 1);
+	uint32_t i;
+
+	while ((i = m->table[j])) {
+		if (m->states[i - 1].key == k)
+			return i - 1;
+		j = (j + 1) & (m->h->tsize - 1);
+	}
+	return NOKEY;
+}
+
+static void model_sections(struct model *m)
+{
+	char *b = (char *)m->h;
+	m->words = (uint64_t *)(b + m->h->words);
+	m->text = b + m->h->text;
+	m->table = (uint32_t *)(b + m->h->table);
+	m->states = (struct mstate *)(b + m->h->states);
+	m->f = (struct follow *)(b + m->h->follow);
+	m->a = (struct alias *)(b + m->h->alias);
+}
+
+void free_dictionary(struct dictionary *d)
+{
+	uint32_t i;
+
+	for (i = 0; i < d->st.count; i++) {
+		mfree(d->s[i].f);
+		mfree(d->s[i].a);
+	}
+	mfree(d->s);
+	keys_free(&d->st);
+	keys_free(&d->ctx);
+	d->s = NULL;
+	d->scap = 0;
+}
+
+// copy the dictionary into a new model, alias tables are made here if it is not frozen
+static struct model *model_build(struct dictionary *d)
+{
+	struct model *m = (struct model *)mmalloc(sizeof(struct model), "model");
+	struct model_header *h;
+	uint64_t nstates = d->st.count, nfollow = 0, textsize = 0, size, i, n, f;
+
+	for (i = 0; i < nstates; i++)
+		nfollow += d->s[i].nf;
+	for (i = 0; i < thew.count; i++)
+		textsize += thew.len[i] + 1;
+	h = (struct model_header *)mmalloc(sizeof(struct model_header), "model");
+	memset(h, 0, sizeof(struct model_header));
+	for (h->tsize = 1; h->tsize < 2 * nstates; h->tsize *= 2) ;
+	h->nwords = thew.count;
+	h->nstates = nstates;
+	h->nfollow = nfollow;
+	h->words = ALIGN8(sizeof(struct model_header));
+	h->text = ALIGN8(h->words + (h->nwords + 1) * sizeof(uint64_t));
+	h->table = ALIGN8(h->text + textsize);
+	h->states = ALIGN8(h->table + h->tsize * sizeof(uint32_t));
+	h->follow = ALIGN8(h->states + nstates * sizeof(struct mstate));
+	h->alias = ALIGN8(h->follow + nfollow * sizeof(struct follow));
+	size = ALIGN8(h->alias + nfollow * sizeof(struct alias));
+	m->h = (struct model_header *)mmalloc(size, "model");
+	memset(m->h, 0, size);
+	*m->h = *h;
+	mfree(h);
+	h = m->h;
+	m->mapped = 0;
+	m->next = NULL;
+	model_sections(m);
+
+	for (i = n = 0; i < thew.count; i++) {
+		size_t z = thew.len[i] + 1;
+		m->words[i] = n;
+		memcpy(m->text + n, thew.w[i], z);
+		n += z;
+	}
+	m->words[i] = n;
+	for (i = f = 0; i < nstates; i++) {
+		struct mstate *p = &m->states[i];
+		struct state *l = &d->s[i];
+		uint64_t j = hashkey(d->st.key[i]) & (h->tsize - 1);
+		p->key = d->st.key[i];
+		p->next = l->next;
+		p->count = l->count;
+		p->nf = l->nf;
+		p->fcount = l->fcount;
+		p->f = f;
+		if (l->nf)	//f is NULL for a state with no followers
+			memcpy(&m->f[f], l->f, l->nf * sizeof(struct follow));
+		if (l->a)
+			memcpy(&m->a[f], l->a, l->nf * sizeof(struct alias));
+		else if (l->nf)
+			make_alias(l, &m->a[f]);
+		f += l->nf;
+		while (m->table[j])
+			j = (j + 1) & (h->tsize - 1);
+		m->table[j] = i + 1;
+	}
+	h->start = 0;
+	h->order = order;
+	memcpy(h->magic, MODEL_MAGIC, sizeof(h->magic));
+	h->version = MODEL_VERSION;
+	h->bom = MODEL_BOM;
+	h->size = size;
+	h->checksum = fnv((char *)h + h->words, size - h->words);
+	h->hcheck = fnv(h, offsetof(struct model_header, hcheck));
+	return m;
+}
+
+// a model from a frozen dictionary, the dictionary and word table are freed
+struct model *Compile_Model(struct dictionary *d)
+{
+	struct model *m = model_build(d);
+
+	free_dictionary(d);
+	words_free(&thew);
+	return m;
+}
+
+static void model_free(struct model *m)
+{
+	if (m->mapped)
+		munmap(m->h, m->h->size);
+	else
+		mfree(m->h);
+	mfree(m);
+}
+
+void Save_Model(struct model *m, char *file)
+{
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	char *b = (char *)m->h;
+	uint64_t n = 0;
+
+	if (fd < 0) {
+		fprintf(stderr, "Can't create %s\n", file);
+		exit(1);
+	}
+	while (n < m->h->size) {
+		ssize_t r = write(fd, b + n, m->h->size - n);
+		if (r <= 0) {
+			fprintf(stderr, "Can't write %s\n", file);
+			exit(1);
+		}
+		n += r;
+	}
+	close(fd);
+}
+
+// the sections are in order, aligned and inside the file, and everything in them only
+// points inside them: words, followers, alias entries and the states followers lead to
+static char *model_bad(struct model_header *h)
+{
+	struct model m;
+	uint64_t i, j;
+
+	if (h->words != ALIGN8(sizeof(struct model_header)) || h->words > h->text || h->text > h->table
+	    || h->table > h->states || h->states > h->follow || h->follow > h->alias || h->alias > h->size
+	    || (h->text | h->table | h->states | h->follow | h->alias) & 7)
+		return "bad section offsets";
+	if (h->nwords >= (h->text - h->words) / sizeof(uint64_t)
+	    || h->tsize > (h->states - h->table) / sizeof(uint32_t)
+	    || h->nstates > (h->follow - h->states) / sizeof(struct mstate)
+	    || h->nfollow > (h->alias - h->follow) / sizeof(struct follow)
+	    || h->nfollow > (h->size - h->alias) / sizeof(struct alias))
+		return "section too small";
+	if (!h->tsize || h->tsize & (h->tsize - 1) || h->tsize <= h->nstates)
+		return "bad table size";
+	if (h->order < 1 || h->order > MAXORDER || h->start >= h->nstates)
+		return "bad order or start state";
+	m.h = h;
+	model_sections(&m);
+	for (i = 0; i < h->nwords; i++)	//each word ends with a 0 before the next starts
+		if (m.words[i] >= m.words[i + 1] || m.words[i + 1] > h->table - h->text
+		    || m.text[m.words[i + 1] - 1])
+			return "bad word offset";
+	for (i = 0; i < h->tsize; i++)
+		if (m.table[i] > h->nstates)
+			return "bad hash table entry";
+	for (i = 0; i < h->nstates; i++) {
+		struct mstate *p = &m.states[i];
+		if (p->f > h->nfollow || p->nf > h->nfollow - p->f || !p->nf != !p->fcount)
+			return "bad follower range";
+		for (j = p->f; j < p->f + p->nf; j++) {
+			if (m.f[j].w >= h->nwords || m.a[j].alias >= p->nf || m.a[j].thresh > p->fcount)
+				return "bad follower";
+			if (model_lookup(&m, p->next, m.f[j].w) == NOKEY)
+				return "follower leads nowhere";
+		}
+	}
+	return NULL;
+}
+
+// map a saved model, check selects checking the whole thing
+struct model *Load_Model(char *file, int check)
+{
+	int fd = open(file, O_RDONLY);
+	struct stat st;
+	struct model_header *h;
+	struct model *m;
+	char *bad = NULL;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Can't open %s\n", file);
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(struct model_header)
+	    || (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "%s is not a model\n", file);
+		close(fd);
 		return NULL;
-	while ( (l = pair_next(p, l))) {
-		if (!strcmp((char *)w1, (char *)l->w1) && !strcmp((char *)w2,(char *) l->w2))
-			return l;
 	}
+	close(fd);
+	if (memcmp(h->magic, MODEL_MAGIC, sizeof(h->magic)) || h->bom != MODEL_BOM
+	    || h->hcheck != fnv(h, offsetof(struct model_header, hcheck))) {
+		fprintf(stderr, "%s is not a model for this machine\n", file);
+	} else if (h->version != MODEL_VERSION) {
+		fprintf(stderr, "%s is model version %u, this program reads version %u\n",
+			file, h->version, MODEL_VERSION);
+	} else if (h->size != (uint64_t)st.st_size) {
+		fprintf(stderr, "%s is truncated\n", file);
+	} else if (check && h->checksum != fnv((char *)h + h->words, h->size - h->words)) {
+		fprintf(stderr, "%s fails checksum\n", file);
+	} else if ((bad = model_bad(h))) {
+		fprintf(stderr, "%s is corrupt: %s\n", file, bad);
+	} else {
+		m = (struct model *)mmalloc(sizeof(struct model), "model");
+		m->h = h;
+		m->mapped = 1;
+		m->next = NULL;
+		model_sections(m);
+		order = h->order;
+		if (verbose)
+			fprintf(stderr, "order %d words %lu states %lu distinct followers %lu, %lu bytes\n",
+				order, (unsigned long)h->nwords, (unsigned long)h->nstates,
+				(unsigned long)h->nfollow, (unsigned long)h->size);
+		return m;
+	}
+	munmap(h, st.st_size);
 	return NULL;
 }
 
-void Write_Markov(struct dictionary *d, int count)	//pure side effect function 
+// pick a follower in constant time
+static inline uint32_t follower(struct model *m, struct mstate *p, struct xoshiro *r)
+{
+	uint32_t j = xo_below(r, p->nf);
+	uint32_t x = xo_below(r, p->fcount);
+	return m->f[p->f + (x < m->a[p->f + j].thresh ? j : m->a[p->f + j].alias)].w;
+}
+// output buffer, grows as needed
+struct obuf {
+	char *b;
+	size_t n, cap;
+};
+
+static inline void obuf_put(struct obuf *o, char *s, size_t n)
+{
+	if (o->n + n > o->cap) {
+		char *b;
+		o->cap = 2 * (o->n + n);
+		b = mmalloc(o->cap, "output buffer");
+		if (o->n)	//o->b is NULL the first time
+			memcpy(b, o->b, o->n);
+		mfree(o->b);
+		o->b = b;
+	}
+	memcpy(o->b + o->n, s, n);
+	o->n += n;
+}
+
+static void write_all(int fd, char *b, size_t n)
+{
+	while (n) {
+		ssize_t r = write(fd, b, n);
+		if (r <= 0) {
+			fprintf(stderr, "Can't write output\n");
+			exit(1);
+		}
+		b += r;
+		n -= r;
+	}
+}
+
+// one stream of up to count words from the start, each after a space, returns how many
+static long sample(struct model *m, int count, struct xoshiro *r, struct obuf *o)
 {
-	struct pair *l = lookup(d, (unsigned char *)"\n", (unsigned char *)"\n");
+	uint32_t i = m->h->start;
+	long n = 0;
 
-	srandom((int)time(0));
+	while (count-- > 0) {
+		struct mstate *l = &m->states[i];
+		uint32_t w;
+		if (!l->fcount)	//the last state in the text
+			break;
+		w = follower(m, l, r);
+		i = model_lookup(m, l->next, w);
+		obuf_put(o, " ", 1);
+		obuf_put(o, model_word(m, w), m->words[w + 1] - m->words[w] - 1);
+		n++;
+		if (i == NOKEY)	//pruned, see Train_Online
+			break;
+	}
+	return n;
+}
 
-	if (!l || pair_isempty(&l)) {
+static int model_ok(struct model *m)
+{
+	if (m->h->start == NOKEY) {
 		fprintf(stderr, "No first word in dictionary\n");
-		exit(1);
+		return 0;
 	}
-	if (!l->fcount) {
+	if (!m->states[m->h->start].fcount) {
 		fprintf(stderr, "First word has no followers\n");
+		return 0;
+	}
+	return 1;
+}
+
+void Write_Markov(struct model *m, int count)	//pure side effect function
+{
+	struct xoshiro r;
+	struct obuf o = { NULL, 0, 0 };
+
+	if (count <= 0)
+		return;
+	if (!model_ok(m))
+		exit(1);
+	xo_seed(&r, seed, 0);
+	sample(m, count, &r, &o);
+	write_all(1, o.b, o.n);
+	mfree(o.b);
+}
+
+/*
+ * Batch generation: samples independent lines of count words. Sample k always
+ * uses random stream k of the seed, and the samples are cut into chunks that
+ * threads take in turn and write out in order, so the output is the same for
+ * any number of threads. Each thread fills its own buffer and only takes a
+ * lock to wait for its turn to write a chunk with one system call.
+ */
+#define SAMPLECHUNK 256
+
+struct gen {
+	struct model *m;
+	int count;
+	long samples;
+	int threads;
+	int id;
+	long words;
+	long during;		//samples served while training, see serve
+};
+
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gen_turn = PTHREAD_COND_INITIALIZER;
+static long gen_next;		//the chunk to write next
+
+static void *generate(void *v)
+{
+	struct gen *g = (struct gen *)v;
+	struct obuf o = { NULL, 0, 0 };
+	struct xoshiro r;
+	long c, k;
+
+	for (c = g->id; c * SAMPLECHUNK < g->samples; c += g->threads) {
+		o.n = 0;
+		for (k = c * SAMPLECHUNK; k < (c + 1) * SAMPLECHUNK && k < g->samples; k++) {
+			xo_seed(&r, seed, k);
+			g->words += sample(g->m, g->count, &r, &o);
+			obuf_put(&o, "\n", 1);
+		}
+		pthread_mutex_lock(&gen_lock);
+		while (gen_next != c)
+			pthread_cond_wait(&gen_turn, &gen_lock);
+		pthread_mutex_unlock(&gen_lock);
+		write_all(1, o.b, o.n);
+		pthread_mutex_lock(&gen_lock);
+		gen_next++;
+		pthread_cond_broadcast(&gen_turn);
+		pthread_mutex_unlock(&gen_lock);
+	}
+	mfree(o.b);
+	return NULL;
+}
+
+void Write_Batch(struct model *m, int count, long samples, int threads)
+{
+	struct gen *g = (struct gen *)mmalloc(threads * sizeof(struct gen), "generators");
+	unsigned long t = millisec();
+	long words = 0;
+	int i;
+
+	if (!model_ok(m))
 		exit(1);
+	for (i = 0; i < threads; i++) {
+		g[i].m = m;
+		g[i].count = count;
+		g[i].samples = samples;
+		g[i].threads = threads;
+		g[i].id = i;
+		g[i].words = 0;
+	}
+	gen_next = 0;
+	run(threads, generate, g, sizeof(struct gen));
+	for (i = 0; i < threads; i++)
+		words += g[i].words;
+	if (verbose) {
+		t = millisec() - t;
+		fprintf(stderr, "generated %ld samples, %ld words with %d thread%s in %lu milliseconds, %.0f words/sec\n",
+			samples, words, threads, threads > 1 ? "s" : "", t,
+			t ? words * 1000.0 / t : 0.0);
+	}
+	mfree(g);
+}
+
+static void words_grow(struct words *wt)
+{
+	unsigned int i, j, size = wt->size ? 2 * wt->size : WORDTABLESIZE;
+	unsigned int *t = (unsigned int *)mmalloc(size * sizeof(unsigned int), "word table");
+	unsigned char **w = (unsigned char **)mmalloc(size / 2 * sizeof(unsigned char *), "word table");
+	unsigned int *len = (unsigned int *)mmalloc(size / 2 * sizeof(unsigned int), "word table");
+
+	memset(t, 0, size * sizeof(unsigned int));
+	for (i = 0; i < wt->count; i++) {
+		j = hashbytes(wt->w[i], wt->len[i]) & (size - 1);
+		while (t[j])
+			j = (j + 1) & (size - 1);
+		t[j] = i + 1;
+		w[i] = wt->w[i];
+		len[i] = wt->len[i];
+	}
+	mfree(wt->t);
+	mfree(wt->w);
+	mfree(wt->len);
+	wt->t = t;
+	wt->w = w;
+	wt->len = len;
+	wt->size = size;
+}
+
+unsigned int intern(struct words *wt, unsigned char *w, int len)
+{
+	unsigned int i, id;
+	unsigned char *s;
+
+	if (2 * (wt->count + 1) > wt->size)
+		words_grow(wt);
+	i = hashbytes(w, len) & (wt->size - 1);
+	while ((id = wt->t[i])) {
+		if (wt->len[id - 1] == (unsigned int)len && !memcmp(wt->w[id - 1], w, len))
+			return id - 1;
+		i = (i + 1) & (wt->size - 1);
+	}
+	if (wt->left < len + 1) {
+		int z = sizeof(unsigned char *) + (len + 1 > WORDCHUNK ? len + 1 : WORDCHUNK);
+		unsigned char *c = (unsigned char *)mmalloc(z, "word text");
+		*(unsigned char **)c = wt->chunks;
+		wt->chunks = c;
+		wt->text = c + sizeof(unsigned char *);
+		wt->left = z - sizeof(unsigned char *);
+	}
+	s = wt->text;
+	memcpy(s, w, len);
+	s[len] = 0;
+	wt->text += len + 1;
+	wt->left -= len + 1;
+	wt->w[wt->count] = s;
+	wt->len[wt->count] = len;
+	wt->t[i] = ++wt->count;
+	return wt->count - 1;
+}
+
+void words_free(struct words *wt)
+{
+	unsigned char *c, *next;
+
+	for (c = wt->chunks; c; c = next) {
+		next = *(unsigned char **)c;
+		mfree(c);
+	}
+	mfree(wt->t);
+	mfree(wt->w);
+	mfree(wt->len);
+	memset(wt, 0, sizeof(struct words));
+}
+
+
+
+/*
+ * Parallel build. The chunk threads (one per chunk) build partial dictionaries
+ * with their own word, context and state ids. Then one thread maps them to merged
+ * ids, chunk by chunk in id order, which adds the contexts and states to the shared
+ * dictionary in the order the one thread build makes them. That part is serial: a
+ * context's merged id depends on its prefix's, and ids go by first appearance. The shard threads merge
+ * the followers of one range of merged states from all the chunks and freeze them.
+ * Nothing is locked: each state belongs to one shard.
+ */
+struct part {
+	unsigned char *b;	//the whole input
+	size_t start, end;	//this chunk
+	struct dictionary d;
+	struct words w;
+	struct edges e;
+	uint32_t *wmap;		//local word id -> merged word id
+	uint32_t *cmap;		//local context id -> merged
+	uint32_t *smap;		//local state id -> merged
+	int first;		//the first chunk
+};
+
+struct shard {
+	struct part *parts;
+	int nparts;
+	uint32_t lo, hi;	//states of this shard
+	struct edges e;
+};
+
+// the start of the last word before pos and its length, -1 if there is none
+static long prevword(unsigned char *b, long pos, int *len)
+{
+	for (;;) {
+		long e, i;
+		while (pos > 0 && isspace(b[pos - 1]))
+			pos--;
+		if (pos == 0)
+			return -1;
+		e = pos;
+		while (pos > 0 && !isspace(b[pos - 1]))
+			pos--;
+		for (i = pos; i < e && !isalpha(b[i]); i++) ;
+		if (i < e) {
+			*len = e - i;
+			return i;
+		}
+	}
+}
+
+static void *part_build(void *v)
+{
+	struct part *t = (struct part *)v;
+	struct wordslice ws[WORDBATCH];
+	long x = t->start, pos[MAXORDER];
+	uint32_t c[MAXORDER], prev[MAXORDER], s;
+	size_t at = t->start;
+	int i, k, len[MAXORDER];
+
+	intern(&t->w, (unsigned char *)"\n", 1);	//local id 0 as in the merged table
+	if (!t->first && t->start == t->end)
+		return NULL;
+	// the state in front of the chunk is the last order words before it, "\n" before the text
+	for (i = order - 1; i >= 0; i--)
+		pos[i] = x = x >= 0 ? prevword(t->b, x, &len[i]) : -1;
+	for (i = 0; i < order; i++)
+		prev[i] = pos[i] >= 0 ? intern(&t->w, t->b + pos[i], len[i]) : 0;
+	window(&t->d, c, prev);
+	// only the first chunk counts it, it is the start
+	s = step(&t->d, c, prev[order - 1], t->first);
+	while ((k = wordsplit(t->b, t->end, &at, 1, ws, WORDBATCH))) {
+		for (i = 0; i < k; i++) {
+			unsigned int w = intern(&t->w, ws[i].w, ws[i].len);
+			add_follower(&t->e, &t->d, s, w, 1);
+			s = step(&t->d, c, w, 1);
+		}
+	}
+	mfree(t->e.t);
+	memset(&t->e, 0, sizeof(struct edges));
+	return NULL;
+}
+
+static inline uint32_t ctx_map(struct part *t, uint32_t c)
+{
+	return c == EMPTY ? EMPTY : t->cmap[c];
+}
+
+// merged ids for the words, contexts and states of a chunk, adding the new ones
+static void part_map(struct part *t)
+{
+	uint32_t j;
+
+	t->wmap = (uint32_t *)mmalloc(t->w.count * sizeof(uint32_t), "word map");
+	for (j = 0; j < t->w.count; j++)
+		t->wmap[j] = intern(&thew, t->w.w[j], t->w.len[j]);
+	// a context only refers to older ones so one pass in id order does it
+	t->cmap = (uint32_t *)mmalloc((t->d.ctx.count + 1) * sizeof(uint32_t), "context map");
+	for (j = 0; j < t->d.ctx.count; j++) {
+		uint64_t k = t->d.ctx.key[j];
+		t->cmap[j] = add_ctx(&thed, ctx_map(t, KEY_CTX(k)), t->wmap[KEY_WORD(k)]);
 	}
+	t->smap = (uint32_t *)mmalloc((t->d.st.count + 1) * sizeof(uint32_t), "state map");
+	for (j = 0; j < t->d.st.count; j++) {
+		uint64_t k = t->d.st.key[j];
+		uint32_t g = add_state(&thed, ctx_map(t, KEY_CTX(k)), t->wmap[KEY_WORD(k)],
+				       t->d.s[j].count);
+		thed.s[g].next = ctx_map(t, t->d.s[j].next);
+		t->smap[j] = g;
+	}
+}
+
+static void *shard_merge(void *v)
+{
+	struct shard *sh = (struct shard *)v;
+	uint32_t i, j;
+	int t;
+
+	for (t = 0; t < sh->nparts; t++) {
+		struct part *p = &sh->parts[t];
+		for (i = 0; i < p->d.st.count; i++) {
+			struct state *l = &p->d.s[i];
+			uint32_t g = p->smap[i];
+			if (g < sh->lo || g >= sh->hi)
+				continue;
+			for (j = 0; j < l->nf; j++)
+				add_follower(&sh->e, &thed, g, p->wmap[l->f[j].w], l->f[j].c);
+		}
+	}
+	mfree(sh->e.t);
+	freeze(&thed, sh->lo, sh->hi);
+	return NULL;
+}
+
+static void *part_free(void *v)
+{
+	struct part *t = (struct part *)v;
+
+	free_dictionary(&t->d);
+	mfree(t->wmap);
+	mfree(t->cmap);
+	mfree(t->smap);
+	words_free(&t->w);
+	return NULL;
+}
+
+// run f on each of n things of size z starting at a, one thread each
+static void run(int n, void *(*f)(void *), void *a, size_t z)
+{
+	pthread_t *th = (pthread_t *)mmalloc(n * sizeof(pthread_t), "threads");
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&th[i], NULL, f, (char *)a + i * z)) {
+			fprintf(stderr, "Can't create thread\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(th[i], NULL);
+	mfree(th);
+}
+
+struct dictionary *Build_Dictionary_Parallel(int fd, int threads)
+{
+	struct wordsrc in;
+	struct part *parts;
+	struct shard *shards;
+	uint32_t width;
+	size_t pos = 0;
+	unsigned long t = millisec(), tchunks, tmap;
+	int i;
+
+	if (wordsrc_open(&in, fd) < 0)
+		return NULL;
+	if (!in.stable) {	//need it all in memory to cut it up
+		if (verbose)
+			fprintf(stderr, "input is not a mappable file, building with one thread\n");
+		wordsrc_close(&in);
+		return Build_Dictionary(fd);
+	}
+	parts = (struct part *)mmalloc(threads * sizeof(struct part), "parts");
+	memset(parts, 0, threads * sizeof(struct part));
+	for (i = 0; i < threads; i++) {	//cut at white space
+		struct part *t = &parts[i];
+		t->b = in.buf;
+		t->start = pos;
+		pos = in.n * (i + 1) / threads;
+		while (pos < in.n && !isspace(in.buf[pos]))
+			pos++;
+		if (pos < t->start)
+			pos = t->start;
+		t->end = pos;
+		t->first = (i == 0);
+	}
+	run(threads, part_build, parts, sizeof(struct part));
+	tchunks = millisec() - t;
+
+	newline = intern(&thew, (unsigned char *)"\n", 1);
+	for (i = 0; i < threads; i++)	//ids in order of first appearance
+		part_map(&parts[i]);
+	tmap = millisec() - t - tchunks;
+
+	width = (thed.st.count + threads - 1) / threads;
+	shards = (struct shard *)mmalloc(threads * sizeof(struct shard), "shards");
+	memset(shards, 0, threads * sizeof(struct shard));
+	for (i = 0; i < threads; i++) {
+		shards[i].parts = parts;
+		shards[i].nparts = threads;
+		shards[i].lo = (uint64_t)i * width < thed.st.count ? i * width : thed.st.count;
+		shards[i].hi = (uint64_t)(i + 1) * width < thed.st.count ? (i + 1) * width : thed.st.count;
+	}
+	run(threads, shard_merge, shards, sizeof(struct shard));
+	if (verbose)
+		fprintf(stderr, "chunks %lu ms, merging ids with one thread %lu ms, followers %lu ms\n",
+			tchunks, tmap, millisec() - t - tchunks - tmap);
+
+	run(threads, part_free, parts, sizeof(struct part));
+	mfree(shards);
+	mfree(parts);
+	wordsrc_close(&in);
+	return &thed;
+}
+
+// probes to find every key in a table, and the longest
+static unsigned long key_probes(struct keys *x, unsigned long *longest)
+{
+	unsigned long total = 0, j;
+
+	*longest = 0;
+	for (j = 0; j < x->size; j++) {
+		unsigned long n;
+		if (!x->t[j])
+			continue;
+		n = ((j - hashkey(x->key[x->t[j] - 1])) & (x->size - 1)) + 1;
+		total += n;
+		if (n > *longest)
+			*longest = n;
+	}
+	return total;
+}
+
+// memory held by the dictionary tables and the word table
+static unsigned long table_bytes(struct dictionary *d)
+{
+	unsigned long bytes;
+	unsigned char *c;
+
+	bytes = d->ctx.size * (sizeof(uint32_t) + sizeof(uint64_t) / 2)
+	    + d->st.size * (sizeof(uint32_t) + sizeof(uint64_t) / 2)
+	    + d->scap * sizeof(struct state)
+	    + thew.size * (sizeof(unsigned int) + (sizeof(unsigned char *) + sizeof(unsigned int)) / 2);
+	for (c = thew.chunks; c; c = *(unsigned char **)c)
+		bytes += WORDCHUNK;
+	return bytes;
+}
+
+// and the follower and alias arrays
+static unsigned long dict_bytes(struct dictionary *d)
+{
+	unsigned long bytes = table_bytes(d);
+	uint32_t i;
+
+	for (i = 0; i < d->st.count; i++)
+		bytes += d->s[i].fcap * sizeof(struct follow)
+		    + (d->s[i].a ? d->s[i].nf * sizeof(struct alias) : 0);
+	return bytes;
+}
+
+// sizes, memory, probe lengths and a checksum of everything in the dictionary
+void Dictionary_Stats(struct dictionary *d)
+{
+	unsigned long distinct = 0, total = 0, bytes = dict_bytes(d), cp, sp, clong, slong;
+	unsigned long sum = 1469598103934665603UL;	//FNV-1a over the contents
+	uint32_t i, j;
+#define MIX(x) (sum = (sum ^ (unsigned long)(x)) * 1099511628211UL)
+
+	for (i = 0; i < d->ctx.count; i++)
+		MIX(d->ctx.key[i]);
+	for (i = 0; i < d->st.count; i++) {
+		struct state *l = &d->s[i];
+		MIX(d->st.key[i]);
+		MIX(l->next);
+		MIX(l->count);
+		for (j = 0; j < l->nf; j++) {
+			MIX(l->f[j].w);
+			MIX(l->f[j].c);
+			MIX(l->a[j].thresh);
+			MIX(l->a[j].alias);
+		}
+		distinct += l->nf;
+		total += l->fcount;
+	}
+	for (i = 0; i < thew.count; i++)
+		MIX(hashbytes(thew.w[i], thew.len[i]));
+#undef MIX
+	cp = key_probes(&d->ctx, &clong);
+	sp = key_probes(&d->st, &slong);
+	fprintf(stderr, "order %d words %u contexts %u states %u followers %lu distinct followers %lu\n",
+		order, thew.count, d->ctx.count, d->st.count, total, distinct);
+	fprintf(stderr, "probes: contexts mean %.2f longest %lu, states mean %.2f longest %lu\n",
+		d->ctx.count ? (double)cp / d->ctx.count : 0.0, clong,
+		d->st.count ? (double)sp / d->st.count : 0.0, slong);
+	fprintf(stderr, "dictionary %lu bytes, %.1f per state, checksum %016lx\n",
+		bytes, d->st.count ? (double)bytes / d->st.count : 0.0, sum);
+}
+
+/*
+ * Online training, -u N. The input is trained on as it arrives and every N words the
+ * dictionary is compiled into a new model, a snapshot, which is published to the
+ * generator threads with one atomic exchange. A generator puts the snapshot it is
+ * about to use in its hazard slot and checks it is still the current one, so the
+ * trainer never frees a snapshot in use and neither side ever waits for the other:
+ * replaced snapshots go on a retired list and are freed by a later publish once no
+ * slot holds them. Each sample comes from one snapshot, so it is always consistent.
+ *
+ * With -M the dictionary, word table and follower index are kept under a memory
+ * budget, not counting the tables at their starting sizes, which they never go below.
+ * When they are over it the counts of the oldest states are halved until about enough
+ * followers have dropped to 0 to leave 3/4 of what fits in the budget (the tables grow
+ * in powers of 2, so it is worked out from the counts, not bytes), those followers and the
+ * states samples can no longer get through are removed along with the contexts and
+ * words nothing uses any more, and the tables are rebuilt at their new size - repeated
+ * only while still over the budget. So n-grams seen once fade out while common ones
+ * stay, and recent text counts for more. The start state is only seen once so it is
+ * left alone, and it always keeps a way into the rest, see prune.
+ */
+#define SNAPSHOT_WAIT 1000000	//nanoseconds a generator sleeps waiting for the first one
+
+static struct model *current;	//the published snapshot
+static struct model **hazard;	//the snapshot each generator is using
+static int nhazard;
+static struct model *retired;	//replaced but maybe still in use
+static long served;		//samples handed out
+static int training;
+
+static int in_use(struct model *m)
+{
+	int i;
+
+	for (i = 0; i < nhazard; i++)
+		if (__atomic_load_n(&hazard[i], __ATOMIC_SEQ_CST) == m)
+			return 1;
+	return 0;
+}
+
+// make m the current snapshot and free the old ones nobody is using
+static void publish(struct model *m)
+{
+	struct model *old = __atomic_exchange_n(&current, m, __ATOMIC_SEQ_CST), **p, *r;
+
+	if (old) {
+		old->next = retired;
+		retired = old;
+	}
+	for (p = &retired; (r = *p);) {
+		if (in_use(r)) {
+			p = &r->next;
+		} else {
+			*p = r->next;
+			model_free(r);
+		}
+	}
+}
+
+// the current snapshot, publish leaves it alone until the slot is cleared
+static struct model *snapshot(int id)
+{
+	struct model *m;
+
 	do {
-		int index = 1 + (random()%l->fcount);
-		l = lookup(d, l->w2, follower(l->f,index));
-		fprintf(stdout, " %s", l->w1);
+		m = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&hazard[id], m, __ATOMIC_SEQ_CST);
+	} while (m != __atomic_load_n(&current, __ATOMIC_SEQ_CST));
+	return m;
+}
+
+static void *serve(void *v)
+{
+	struct gen *g = (struct gen *)v;
+	struct obuf o = { NULL, 0, 0 };
+	struct timespec pause = { 0, SNAPSHOT_WAIT };
+	struct xoshiro r;
+	struct model *m;
+	long k;
+
+	while ((k = __atomic_fetch_add(&served, 1, __ATOMIC_RELAXED)) < g->samples) {
+		while (!(m = snapshot(g->id)))
+			nanosleep(&pause, NULL);
+		o.n = 0;
+		xo_seed(&r, seed, k);
+		g->words += sample(m, g->count, &r, &o);
+		__atomic_store_n(&hazard[g->id], NULL, __ATOMIC_RELEASE);
+		if (__atomic_load_n(&training, __ATOMIC_RELAXED))
+			g->during++;
+		obuf_put(&o, "\n", 1);
+		pthread_mutex_lock(&gen_lock);
+		write_all(1, o.b, o.n);
+		pthread_mutex_unlock(&gen_lock);
 	}
-	while (l && (--count > 0));
+	mfree(o.b);
+	return NULL;
 }
 
-#define follower_t struct follow
-#include "follower_ll.h"  //the follower linked list operates on types follower_t 
+static void edge_put(struct edges *x, uint32_t s, unsigned int w, unsigned int i)
+{
+	unsigned long j;
 
-struct pair *add_pair(struct dictionary *d, unsigned char *w1, unsigned char *w2)
+	if (2 * (x->count + 1) > x->size)
+		edges_grow(x);
+	for (j = edge_hash(s + 1, w, x->size); x->t[j].s; j = (j + 1) & (x->size - 1)) ;
+	x->t[j].s = s + 1;
+	x->t[j].w = w;
+	x->t[j].i = i;
+	x->count++;
+}
+
+/*
+ * left[i] is how many followers of state i lead to live states, a state being live if
+ * one of its followers leads to a live state: the ones that are not are found by working
+ * back from the states with no such follower. Only followers with a count left are used
+ * unless all is set. to[first[i] + j] is where follower j of state i leads, q is room
+ * for every state.
+ */
+static void live(struct dictionary *d, unsigned long *first, uint32_t *to, int all,
+		 uint32_t *left, uint32_t *q)
 {
-	struct pair *l = lookup(d, w1, w2);
+	unsigned long *rfirst, edges, qh, qt;
+	uint32_t i, j, t, *from;
+
+	rfirst = (unsigned long *)mmalloc((d->st.count + 1) * sizeof(unsigned long), "prune map");
+	memset(rfirst, 0, (d->st.count + 1) * sizeof(unsigned long));
+	memset(left, 0, d->st.count * sizeof(uint32_t));
+	for (i = 0; i < d->st.count; i++)
+		for (j = 0; j < d->s[i].nf; j++)
+			if ((t = to[first[i] + j]) != NOKEY && (all || d->s[i].f[j].c)) {
+				left[i]++;
+				rfirst[t]++;
+			}
+	for (i = 0, edges = 0; i <= d->st.count; i++) {	//rfirst[t] is where t's list ends
+		edges += rfirst[i];
+		rfirst[i] = edges;
+	}
+	from = (uint32_t *)mmalloc((edges + 1) * sizeof(uint32_t), "prune map");
+	for (i = 0; i < d->st.count; i++)
+		for (j = 0; j < d->s[i].nf; j++)
+			if ((t = to[first[i] + j]) != NOKEY && (all || d->s[i].f[j].c))
+				from[--rfirst[t]] = i;	//and now where it starts
+	for (i = 0, qt = 0; i < d->st.count; i++)
+		if (!left[i])
+			q[qt++] = i;
+	for (qh = 0; qh < qt; qh++)
+		for (edges = rfirst[q[qh]]; edges < rfirst[q[qh] + 1]; edges++)
+			if (!--left[from[edges]])
+				q[qt++] = from[edges];
+	mfree(rfirst);
+	mfree(from);
+}
 
-	if (l == NULL) {	// not there
-		int h = hash2strings(w1, w2);
-		if (d->H[h] == NULL)
-			pair_init(&d->H[h]);
-		l = (struct pair *)mmalloc(sizeof(struct pair), "add pair");
-		l->w1 = w1;
-		l->w2 = w2;
-		l->count = 1;
+/*
+ * Halve the counts of the oldest states until drop followers have gone to 0, then keep
+ * only the live states, the ones a sample can pass through without getting stuck. If
+ * the start is not live, the shortest way from it to a live state keeps its followers
+ * at count 1, or if there is none the walk from it along the biggest counts that never
+ * gets stuck is kept until it comes round to itself. So every sample is as long as
+ * before. The start and the trainer's state always stay. Then everything is renumbered
+ * in the same order.
+ */
+static void prune(struct dictionary *d, struct edges *e, uint32_t *c, uint32_t *s, unsigned long drop)
+{
+	uint32_t i, j, n, t, *smap, *cmap, *wmap, *to, *left, *back;
+	unsigned long *first, edges, qh, qt;
+	struct keys ctx, st;
+	struct words w;
+	int k;
+
+	for (i = 1; i < d->st.count && drop; i++) {	//the start is only seen once
+		struct state *l = &d->s[i];
+		l->count /= 2;
+		for (j = 0; j < l->nf; j++)
+			if (!(l->f[j].c /= 2) && drop)
+				drop--;
+	}
+
+	// where each follower leads
+	first = (unsigned long *)mmalloc((d->st.count + 1) * sizeof(unsigned long), "prune map");
+	for (i = 0, edges = 0; i < d->st.count; i++) {
+		first[i] = edges;
+		edges += d->s[i].nf;
+	}
+	first[i] = edges;
+	to = (uint32_t *)mmalloc((edges + 1) * sizeof(uint32_t), "prune map");
+	for (i = 0; i < d->st.count; i++)
+		for (j = 0; j < d->s[i].nf; j++)
+			to[first[i] + j] = key_find(&d->st, KEY(d->s[i].next, d->s[i].f[j].w));
+	left = (uint32_t *)mmalloc(d->st.count * sizeof(uint32_t), "prune map");
+	smap = (uint32_t *)mmalloc(d->st.count * sizeof(uint32_t), "prune map");
+	live(d, first, to, 0, left, smap);
+
+	// a way from the start to the live states
+	if (!left[0]) {
+		back = (uint32_t *)mmalloc(d->st.count * sizeof(uint32_t), "prune map");
+		memset(back, 0xff, d->st.count * sizeof(uint32_t));
+		back[0] = 0;
+		smap[0] = 0;
+		for (qh = 0, qt = 1, n = NOKEY; qh < qt && n == NOKEY; qh++) {
+			i = smap[qh];
+			for (j = 0; j < d->s[i].nf; j++) {
+				if ((t = to[first[i] + j]) == NOKEY || back[t] != NOKEY)
+					continue;
+				back[t] = i;
+				if (left[t]) {
+					n = t;
+					break;
+				}
+				smap[qt++] = t;
+			}
+		}
+		for (t = n; t != NOKEY && t != 0; t = i) {
+			i = back[t];
+			for (j = 0; to[first[i] + j] != t; j++) ;
+			if (!d->s[i].f[j].c)
+				d->s[i].f[j].c = 1;
+			left[i]++;
+		}
+		if (n == NOKEY) {	//or round a loop, back is live counting every follower
+			live(d, first, to, 1, back, smap);
+			for (i = 0; back[i] && !left[i]; i = t) {
+				for (j = 0, n = NOKEY, t = NOKEY; j < d->s[i].nf; j++) {
+					uint32_t x = to[first[i] + j];
+					if (x != NOKEY && back[x] && (n == NOKEY || d->s[i].f[j].c > d->s[i].f[n].c)) {
+						n = j;
+						t = x;
+					}
+				}
+				if (!d->s[i].f[n].c)
+					d->s[i].f[n].c = 1;
+				left[i]++;
+			}
+		}
+		mfree(back);
+	}
+
+	cmap = (uint32_t *)mmalloc((d->ctx.count + 1) * sizeof(uint32_t), "prune map");
+	wmap = (uint32_t *)mmalloc(thew.count * sizeof(uint32_t), "prune map");
+	memset(cmap, 0xff, (d->ctx.count + 1) * sizeof(uint32_t));
+	memset(wmap, 0xff, thew.count * sizeof(uint32_t));
+	// mark what stays: 0 is kept, NOKEY goes
+	for (i = 0; i < d->st.count; i++) {
+		struct state *l = &d->s[i];
+		uint64_t key = d->st.key[i];
 		l->fcount = 0;
-		follower_init(&(l->f));
-		pair_enq(&d->H[h], l);
-	} else {
-		l->count++;
+		for (j = n = 0; j < l->nf; j++) {
+			t = to[first[i] + j];
+			if (l->f[j].c && t != NOKEY && left[t]) {
+				l->f[n++] = l->f[j];
+				l->fcount += l->f[j].c;
+			}
+		}
+		l->nf = n;
+		if (!left[i] && i > 0 && i != *s) {
+			smap[i] = NOKEY;
+			continue;
+		}
+		smap[i] = 0;
+		if (KEY_CTX(key) != EMPTY)
+			cmap[KEY_CTX(key)] = 0;
+		if (l->next != EMPTY)
+			cmap[l->next] = 0;
+		wmap[KEY_WORD(key)] = 0;
+		for (j = 0; j < l->nf; j++)
+			wmap[l->f[j].w] = 0;
+	}
+	mfree(first);
+	mfree(left);
+	mfree(to);
+	for (k = 1; k < order; k++)
+		cmap[c[k]] = 0;
+	for (i = d->ctx.count; i-- > 0;) {	//a context is newer than its prefix
+		uint64_t key = d->ctx.key[i];
+		if (cmap[i] == NOKEY)
+			continue;
+		if (KEY_CTX(key) != EMPTY)
+			cmap[KEY_CTX(key)] = 0;
+		wmap[KEY_WORD(key)] = 0;
 	}
-	return l;
+	wmap[newline] = 0;
 
+	// renumber
+	memset(&w, 0, sizeof(struct words));
+	for (i = 0; i < thew.count; i++)
+		if (wmap[i] != NOKEY)
+			wmap[i] = intern(&w, thew.w[i], thew.len[i]);
+	newline = wmap[newline];
+	words_free(&thew);
+	thew = w;
+	memset(&ctx, 0, sizeof(struct keys));
+	for (i = 0; i < d->ctx.count; i++) {
+		uint64_t key = d->ctx.key[i];
+		if (cmap[i] != NOKEY)
+			cmap[i] = key_add(&ctx, KEY(KEY_CTX(key) == EMPTY ? EMPTY : cmap[KEY_CTX(key)],
+						    wmap[KEY_WORD(key)]));
+	}
+	keys_free(&d->ctx);
+	d->ctx = ctx;
+	memset(&st, 0, sizeof(struct keys));
+	for (i = n = 0; i < d->st.count; i++) {
+		uint64_t key = d->st.key[i];
+		struct state *l = &d->s[i];
+		if (smap[i] == NOKEY) {
+			mfree(l->f);
+			continue;
+		}
+		smap[i] = key_add(&st, KEY(KEY_CTX(key) == EMPTY ? EMPTY : cmap[KEY_CTX(key)],
+					   wmap[KEY_WORD(key)]));
+		if (l->next != EMPTY)
+			l->next = cmap[l->next];
+		for (j = 0; j < l->nf; j++)
+			l->f[j].w = wmap[l->f[j].w];
+		if (!l->nf) {
+			mfree(l->f);
+			l->f = NULL;
+			l->fcap = 0;
+		}
+		d->s[n++] = *l;
+	}
+	keys_free(&d->st);
+	d->st = st;
+	if (d->scap > st.size / 2) {	//shrink
+		struct state *x = (struct state *)mmalloc(st.size / 2 * sizeof(struct state), "states");
+		memcpy(x, d->s, n * sizeof(struct state));
+		mfree(d->s);
+		d->s = x;
+		d->scap = st.size / 2;
+	}
+	mfree(e->t);
+	memset(e, 0, sizeof(struct edges));
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < d->s[i].nf; j++)
+			edge_put(e, i, d->s[i].f[j].w, j);
+		e->fbytes += d->s[i].fcap * sizeof(struct follow);
+	}
+	for (k = 1; k < order; k++)
+		c[k] = cmap[c[k]];
+	*s = smap[*s];
+	mfree(smap);
+	mfree(cmap);
+	mfree(wmap);
 }
 
-void add_follower(struct pair *p, unsigned char *w)
+// what -M limits past the starting tables, cheap enough to check after every batch
+static unsigned long online_bytes(void)
 {
-	struct follow *f =
-	    (struct follow *)mmalloc(sizeof(struct follow), "add follower");
-	if(p->fcount++ == 0)follower_init(&p->f);
-	f->w = w;
-	follower_enq(&(p->f),f);
+	return table_bytes(&thed) + thee.fbytes + thee.size * sizeof(struct edge);
 }
 
-//this could be optimized by reversing order of search if k> fcount/2
-unsigned char *follower(struct follow *fq, int k)
+// the size a table starting at first grows to for n entries, see key_add
+static unsigned long grown(unsigned long n, unsigned long first)
 {
-	int i = 0;
-	struct follow *f= NULL;
-	do {
-		i++;
-		f = follower_next(&fq, f);
-	} while (f && (i < k));
-	if (i != k) {
-		fprintf(stderr, "follower sent past end of queue i=%d k=%d\n",
-			i, k);
-		exit(-1);	//not recoverable
-	}
-	return f->w;
-}
-
-//this should probably be fixed to not mangle words that cross buffer boundaries
-unsigned char *getword(int fd)
-{
-	static unsigned char *buf = NULL;
-	static int nextc = 0;
-	static int n = 0;
-	int i, j;
-	if (!buf || ((CHARBUFSIZE - nextc) <= WORDSIZE)) {
-		buf = (unsigned char *)mmalloc(CHARBUFSIZE, "character buffer");
-		nextc = 0;
-		n = read(fd, buf, CHARBUFSIZE);
-		if (n < 1)
-			return 0;
-	}
-	if (nextc > n)
+	unsigned long size = first;
+
+	if (!n)
 		return 0;
-	for (i = nextc; !isalpha(buf[i]); i++) ;
-	for (j = i; !isspace(buf[j]) && (buf[j] != '\n') && j < n; j++) ;
-	if (j < n)
-		buf[j] = 0;
-	else buf[n-1]=0;
-	nextc = j;
-	return &buf[i];
+	while (2 * (n + 1) > size)
+		size *= 2;
+	return size;
+}
+
+// about what online_bytes would be with f times as many of everything
+static unsigned long online_scaled(double f)
+{
+	unsigned long st = grown(thed.st.count * f, KEYTABLESIZE), chunks = 0;
+	unsigned char *c;
+
+	for (c = thew.chunks; c; c = *(unsigned char **)c)
+		chunks++;
+	return grown(thed.ctx.count * f, KEYTABLESIZE) * (sizeof(uint32_t) + sizeof(uint64_t) / 2)
+	    + st * (sizeof(uint32_t) + sizeof(uint64_t) / 2) + st / 2 * sizeof(struct state)
+	    + grown(thew.count * f, WORDTABLESIZE)
+	    * (sizeof(unsigned int) + (sizeof(unsigned char *) + sizeof(unsigned int)) / 2)
+	    + (unsigned long)(chunks * f + 1) * WORDCHUNK + (unsigned long)(thee.fbytes * f)
+	    + grown(thee.count * f, EDGETABLESIZE) * sizeof(struct edge);
+}
+
+void Train_Online(int fd, long every, unsigned long budget, int count, long samples,
+		  int threads, char *save)
+{
+	struct wordsrc in;
+	struct wordslice v[WORDBATCH];
+	uint32_t c[MAXORDER], start[MAXORDER], s;
+	struct gen *g = NULL;
+	pthread_t *th = NULL;
+	unsigned long t = millisec(), words = 0, bytes, base;
+	long snapshots = 0, prunes = 0, during = 0;
+	struct model *r;
+	int i, k;
+
+	if (wordsrc_open(&in, fd) < 0) {
+		fprintf(stderr, "Can't read input\n");
+		exit(1);
+	}
+	newline = intern(&thew, (unsigned char *)"\n", 1);
+	for (i = 0; i < order; i++)
+		start[i] = newline;
+	window(&thed, c, start);
+	s = step(&thed, c, newline, 1);
+	base = online_bytes() + EDGETABLESIZE * sizeof(struct edge);	//the smallest tables
+	training = 1;
+	if (samples > 0) {
+		nhazard = threads;
+		hazard = (struct model **)mmalloc(threads * sizeof(struct model *), "hazard slots");
+		memset(hazard, 0, threads * sizeof(struct model *));
+		g = (struct gen *)mmalloc(threads * sizeof(struct gen), "generators");
+		th = (pthread_t *)mmalloc(threads * sizeof(pthread_t), "threads");
+		for (i = 0; i < threads; i++) {
+			memset(&g[i], 0, sizeof(struct gen));
+			g[i].count = count;
+			g[i].samples = samples;
+			g[i].id = i;
+			if (pthread_create(&th[i], NULL, serve, &g[i])) {
+				fprintf(stderr, "Can't create thread\n");
+				exit(1);
+			}
+		}
+	}
+	do {
+		k = wordsrc_batch(&in, v, WORDBATCH);
+		for (i = 0; i < k; i++) {
+			unsigned int w = intern(&thew, v[i].w, v[i].len);
+			add_follower(&thee, &thed, s, w, 1);
+			s = step(&thed, c, w, 1);
+			if (++words % every)
+				continue;
+			publish(model_build(&thed));
+			snapshots++;
+			if (verbose)
+				fprintf(stderr, "snapshot %ld after %lu words: %u states %lu bytes\n",
+					snapshots, words, thed.st.count, (unsigned long)current->h->size);
+		}
+		while (budget && (bytes = online_bytes()) > base + budget) {
+			uint32_t before = thed.st.count;
+			double f;
+			for (f = 1; f > 0.05 && online_scaled(f) > base + budget; f -= 1.0 / 64) ;	//what fits
+			prune(&thed, &thee, c, &s, (unsigned long)(thee.count * (1 - f / 4 * 3)));
+			prunes++;
+			if (verbose)
+				fprintf(stderr, "pruned %lu bytes to %lu: %u states %u contexts %u words\n",
+					bytes, online_bytes(), thed.st.count, thed.ctx.count, thew.count);
+			if (thed.st.count == before)
+				break;
+		}
+	} while (k);
+	wordsrc_close(&in);
+	if (words % every || !words)
+		publish(model_build(&thed));
+	__atomic_store_n(&training, 0, __ATOMIC_RELAXED);
+	for (i = 0; samples > 0 && i < threads; i++) {
+		pthread_join(th[i], NULL);
+		during += g[i].during;
+	}
+	if (verbose) {
+		fprintf(stderr, "trained on %lu words in %lu milliseconds, %ld snapshots, %ld prunes\n",
+			words, millisec() - t, snapshots, prunes);
+		if (samples > 0)
+			fprintf(stderr, "served %ld samples, %ld while training\n", samples, during);
+	}
+	if (save)
+		Save_Model(current, save);
+	if (samples <= 0)
+		Write_Markov(current, count);
+	while ((r = retired)) {
+		retired = r->next;
+		model_free(r);
+	}
+	model_free(current);
+	current = NULL;
+	free_dictionary(&thed);
+	words_free(&thew);
+	mfree(thee.t);
+	memset(&thee, 0, sizeof(struct edges));
+	mfree(hazard);
+	mfree(g);
+	mfree(th);
+}
+
+unsigned long millisec(void)
+{
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t)) {
+		fprintf(stdout, "Can't read time\n");
+	}
+
+	return t.tv_sec * 1000 + ((unsigned long)t.tv_nsec) / (1000 * 1000);
 }
@@ -0,0 +1,417 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Phase benchmark for markov.c
+
+ use: markov_bench [-w words] [-V vocabulary] [-z exponent] [-s seed] [-k order]
+                   [-n words] [-r trials] [-g] [file]
+
+Makes a synthetic corpus (or reads file) and runs the markov pipeline one
+phase at a time so each can be timed on its own:
+	tokenize	wordsplit into slices
+	intern		slices to word ids
+	train		contexts, states and followers (step and add_follower)
+	freeze		trim follower arrays, make alias tables
+	compile		copy into a model
+	generate	-n words of samples into a buffer (follower and model_lookup)
+	output		write the buffer to /dev/null
+Each phase is run -r times (default 3) and the JSON on standard output has
+the fastest and median time per phase, ns per word (generate and output per
+word actually generated, samples stop early if they reach the end of the
+text), peak RSS after it, and the sizes and probe lengths of the context and
+state hash tables. The accounting in mmalloc.h would be timed along with the
+phases, so markov_bench is built without it and markov_bench_acct, built with
+it, makes one untimed pass instead and has the allocations made in each
+phase and the live bytes after it in place of the times.
+
+The corpus is -w words (default 5000000) drawn from a vocabulary of -V words
+(default 50000) with Zipf distribution: the word of rank r has weight
+1/r^z (default z 1.0). It only depends on the options and -s seed, so the
+same options give the same text on any machine. -g writes it to standard
+output instead, to feed to markov itself.
+*/
+
+#define main markov_main
+#include "markov.c"
+#undef main
+
+#include <math.h>
+#include <sys/resource.h>
+
+#define TRIALS 3
+#define MAXTRIALS 64
+#define SAMPLEWORDS 1000	//words per sample in the generate phase
+
+enum { TOKENIZE, INTERN, TRAIN, FREEZE, COMPILE, GENERATE, OUTPUT, NPHASES };
+static char *phase_name[NPHASES] = {
+	"tokenize", "intern", "train", "freeze", "compile", "generate", "output"
+};
+
+struct phase {
+	double ms[MAXTRIALS];
+#ifdef MMALLOC_ACCOUNTING
+	long allocs;		//during the phase
+	long live;		//after it
+#endif
+	long maxrss;		//KB, after it
+};
+
+static struct phase phases[NPHASES];
+static unsigned char *text;
+static size_t textn;
+
+static double now_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+// word of rank r: letters from a hash of r, 1 to 12 of them, shorter for common words
+static int rank_word(unsigned long r, unsigned char *w)
+{
+	uint64_t x = r * 0x9E3779B97F4A7C15UL + 1;
+	int len = 1 + (int)log2(r + 2) / 2 + (int)((x >> 60) % 4), i;
+
+	if (len > 12)
+		len = 12;
+	for (i = 0; i < len; i++) {
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+		w[i] = 'a' + (x >> 33) % 26;
+	}
+	return len;
+}
+
+static void make_corpus(long words, long vocab, double z, unsigned int s)
+{
+	double *cdf = (double *)mmalloc(vocab * sizeof(double), "corpus cdf");
+	unsigned char (*v)[13] = (unsigned char (*)[13])mmalloc(vocab * 13, "corpus words");
+	unsigned char *vlen = (unsigned char *)mmalloc(vocab, "corpus words");
+	struct xoshiro r;
+	size_t cap = words * 8 + 64;
+	double sum = 0;
+	long i;
+
+	for (i = 0; i < vocab; i++) {
+		sum += pow(i + 1, -z);
+		cdf[i] = sum;
+		vlen[i] = rank_word(i, v[i]);
+	}
+	text = (unsigned char *)mmalloc(cap, "corpus");
+	textn = 0;
+	xo_seed(&r, s, 0);
+	for (i = 0; i < words; i++) {
+		double u = xo_double(&r) * sum;
+		long lo = 0, hi = vocab - 1;
+		while (lo < hi) {	//first rank with cdf > u
+			long mid = (lo + hi) / 2;
+			if (cdf[mid] > u)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		if (textn + 16 > cap) {
+			unsigned char *b = (unsigned char *)mmalloc(2 * cap, "corpus");
+			memcpy(b, text, textn);
+			mfree(text);
+			text = b;
+			cap *= 2;
+		}
+		memcpy(text + textn, v[lo], vlen[lo]);
+		textn += vlen[lo];
+		text[textn++] = xo_below(&r, 12) ? ' ' : '\n';
+	}
+	mfree(cdf);
+	mfree(v);
+	mfree(vlen);
+}
+
+static void load_corpus(char *file)
+{
+	struct wordsrc in;
+	int fd = open(file, O_RDONLY);
+
+	if (fd < 0 || wordsrc_open(&in, fd) < 0 || !in.stable) {
+		fprintf(stderr, "Can't map %s\n", file);
+		exit(1);
+	}
+	text = in.buf;
+	textn = in.n;
+}
+
+static long maxrss(void)
+{
+	struct rusage u;
+	getrusage(RUSAGE_SELF, &u);
+	return u.ru_maxrss;
+}
+
+static double start_ms;
+#ifdef MMALLOC_ACCOUNTING
+static long start_allocs;
+#endif
+
+static void begin(void)
+{
+#ifdef MMALLOC_ACCOUNTING
+	long live;
+	mmalloc_totals(&start_allocs, &live);
+#endif
+	start_ms = now_ms();
+}
+
+static void end(int p, int trial)
+{
+	phases[p].ms[trial] = now_ms() - start_ms;
+#ifdef MMALLOC_ACCOUNTING
+	mmalloc_totals(&phases[p].allocs, &phases[p].live);
+	phases[p].allocs -= start_allocs;
+#endif
+	phases[p].maxrss = maxrss();
+}
+
+#ifndef MMALLOC_ACCOUNTING
+static int bydouble(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y;
+}
+#endif
+
+// probe length of every key: mean, 99th percentile and longest
+struct probes {
+	double mean;
+	unsigned long p99, max;
+};
+
+static struct probes table_probes(struct keys *x)
+{
+	unsigned long hist[65] = { 0 }, n = 0, total = 0, j, seen;
+	struct probes p = { 0, 0, 0 };
+
+	for (j = 0; j < x->size; j++) {
+		unsigned long d;
+		if (!x->t[j])
+			continue;
+		d = ((j - hashkey(x->key[x->t[j] - 1])) & (x->size - 1)) + 1;
+		hist[d < 64 ? d : 64]++;
+		total += d;
+		n++;
+		if (d > p.max)
+			p.max = d;
+	}
+	if (!n)
+		return p;
+	p.mean = (double)total / n;
+	for (j = 1, seen = 0; j <= 64; j++)
+		if ((seen += hist[j]) * 100 >= n * 99)
+			break;
+	p.p99 = j;
+	return p;
+}
+
+static void print_table(char *name, struct keys *x, struct probes p, int last)
+{
+	printf("    \"%s\": {\"keys\": %u, \"slots\": %lu, \"load\": %.3f, "
+	       "\"probe_mean\": %.3f, \"probe_p99\": %lu, \"probe_max\": %lu}%s\n",
+	       name, x->count, (unsigned long)x->size,
+	       x->size ? (double)x->count / x->size : 0.0, p.mean, p.p99, p.max,
+	       last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+	long nwords = 5000000, vocab = 50000, gen = 1000000, words = 0, generated = 0, n;
+	int trials = TRIALS, only_corpus = 0, c, t, i, k, p, null;
+	double z = 1.0, corpus_ms;
+	char *file = NULL;
+	struct wordslice *ws = NULL;
+	uint32_t *ids = NULL;
+	unsigned long distinct = 0, dbytes = 0, mbytes = 0;
+	struct keys ctxs = { NULL, 0, 0, NULL }, states = ctxs;
+	struct probes cp, sp;
+	unsigned int nw = 0;
+
+	seed = 1;
+	while ((c = getopt(argc, argv, "w:V:z:s:k:n:r:g")) != -1) {
+		switch (c) {
+		case 'w':
+			nwords = atol(optarg);
+			break;
+		case 'V':
+			vocab = atol(optarg);
+			break;
+		case 'z':
+			z = atof(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			order = atoi(optarg);
+			break;
+		case 'n':
+			gen = atol(optarg);
+			break;
+		case 'r':
+			trials = atoi(optarg);
+			break;
+		case 'g':
+			only_corpus = 1;
+			break;
+		default:
+			fprintf(stderr, "use: markov_bench [-w words] [-V vocabulary] [-z exponent] [-s seed] [-k order]\n"
+				"                    [-n words] [-r trials] [-g] [file]\n");
+			exit(1);
+		}
+	}
+	if (order < 1 || order > MAXORDER || trials < 1 || trials > MAXTRIALS
+	    || nwords < 1 || vocab < 1) {
+		fprintf(stderr, "bad options: order 1 to %d, trials 1 to %d\n", MAXORDER, MAXTRIALS);
+		exit(1);
+	}
+	if (optind < argc)
+		file = argv[optind];
+#ifdef MMALLOC_ACCOUNTING
+	trials = 1;		//the counts are the same every time
+#endif
+
+	corpus_ms = now_ms();
+	if (file)
+		load_corpus(file);
+	else
+		make_corpus(nwords, vocab, z, seed);
+	corpus_ms = now_ms() - corpus_ms;
+	if (only_corpus) {
+		write_all(1, (char *)text, textn);
+		return 0;
+	}
+	null = open("/dev/null", O_WRONLY);
+
+	for (t = 0; t < trials; t++) {
+		struct model *m;
+		struct obuf o = { NULL, 0, 0 };
+		uint32_t cx[MAXORDER], start[MAXORDER], s;
+		struct xoshiro r;
+		size_t at = 0;
+		long cap = 1024;
+
+		begin();
+		ws = (struct wordslice *)mmalloc(cap * sizeof(struct wordslice), "slices");
+		words = 0;
+		for (;;) {
+			if (words + WORDBATCH > cap) {
+				struct wordslice *x = (struct wordslice *)mmalloc(2 * cap * sizeof(struct wordslice), "slices");
+				memcpy(x, ws, words * sizeof(struct wordslice));
+				mfree(ws);
+				ws = x;
+				cap *= 2;
+			}
+			if (!(k = wordsplit(text, textn, &at, 1, ws + words, WORDBATCH)))
+				break;
+			words += k;
+		}
+		end(TOKENIZE, t);
+
+		begin();
+		ids = (uint32_t *)mmalloc(words * sizeof(uint32_t) + 1, "ids");
+		newline = intern(&thew, (unsigned char *)"\n", 1);
+		for (n = 0; n < words; n++)
+			ids[n] = intern(&thew, ws[n].w, ws[n].len);
+		end(INTERN, t);
+		mfree(ws);
+
+		begin();
+		for (i = 0; i < order; i++)
+			start[i] = newline;
+		window(&thed, cx, start);
+		s = step(&thed, cx, newline, 1);
+		for (n = 0; n < words; n++) {
+			add_follower(&thee, &thed, s, ids[n], 1);
+			s = step(&thed, cx, ids[n], 1);
+		}
+		mfree(thee.t);
+		memset(&thee, 0, sizeof(struct edges));
+		end(TRAIN, t);
+		mfree(ids);
+
+		begin();
+		freeze(&thed, 0, thed.st.count);
+		end(FREEZE, t);
+
+		if (t == trials - 1) {	//table statistics before compile frees them
+			ctxs = thed.ctx;
+			states = thed.st;
+			cp = table_probes(&thed.ctx);
+			sp = table_probes(&thed.st);
+			for (n = 0; n < (long)thed.st.count; n++)
+				distinct += thed.s[n].nf;
+			dbytes = dict_bytes(&thed);
+			nw = thew.count;
+		}
+
+		begin();
+		m = Compile_Model(&thed);
+		end(COMPILE, t);
+		mbytes = m->h->size;
+
+		begin();
+		for (n = 0, k = 0; n < gen; k++) {
+			long got;
+			xo_seed(&r, seed, k);
+			got = sample(m, gen - n < SAMPLEWORDS ? gen - n : SAMPLEWORDS, &r, &o);
+			obuf_put(&o, "\n", 1);
+			if (!got)	//nothing follows the start
+				break;
+			n += got;
+		}
+		end(GENERATE, t);
+		generated = n;
+
+		begin();
+		write_all(null, o.b, o.n);
+		end(OUTPUT, t);
+		mfree(o.b);
+		model_free(m);
+	}
+
+	printf("{\n  \"corpus\": {\"source\": \"%s\", \"bytes\": %lu, \"words\": %ld, ",
+	       file ? file : "zipf", (unsigned long)textn, words);
+	if (file)
+		printf("\"ms\": %.3f},\n", corpus_ms);
+	else
+		printf("\"vocabulary\": %ld, \"zipf\": %g, \"seed\": %u, \"ms\": %.3f},\n",
+		       vocab, z, seed, corpus_ms);
+	printf("  \"order\": %d,\n  \"trials\": %d,\n  \"generate_words\": %ld,\n  \"generated_words\": %ld,\n",
+	       order, trials, gen, generated);
+#ifdef MMALLOC_ACCOUNTING
+	printf("  \"accounting\": true,\n  \"phases\": {\n");
+	for (p = 0; p < NPHASES; p++)
+		printf("    \"%s\": {\"allocs\": %ld, \"live_bytes\": %ld, \"maxrss_kb\": %ld}%s\n",
+		       phase_name[p], phases[p].allocs, phases[p].live, phases[p].maxrss,
+		       p < NPHASES - 1 ? "," : "");
+#else
+	printf("  \"accounting\": false,\n  \"phases\": {\n");
+	for (p = 0; p < NPHASES; p++) {
+		struct phase *x = &phases[p];
+		long per = p >= GENERATE ? generated : words;
+		qsort(x->ms, trials, sizeof(double), bydouble);
+		printf("    \"%s\": {\"ms_min\": %.3f, \"ms_median\": %.3f, \"ns_per_word\": %.2f, "
+		       "\"maxrss_kb\": %ld}%s\n",
+		       phase_name[p], x->ms[0], x->ms[trials / 2],
+		       per ? x->ms[0] * 1e6 / per : 0.0, x->maxrss, p < NPHASES - 1 ? "," : "");
+	}
+#endif
+	printf("  },\n  \"dictionary\": {\n    \"words\": %u, \"contexts\": %u, \"states\": %u, "
+	       "\"distinct_followers\": %lu, \"bytes\": %lu, \"model_bytes\": %lu,\n",
+	       nw, ctxs.count, states.count, distinct, dbytes, mbytes);
+	print_table("context_table", &ctxs, cp, 0);
+	print_table("state_table", &states, sp, 1);
+	printf("  },\n  \"maxrss_kb\": %ld\n}\n", maxrss());
+	return 0;
+}
@@ -0,0 +1,301 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Tests for the -M pruning and model loading in markov.c
+
+ use: markov_test
+
+Trains the online dictionary on generated text with a few common words and
+many rare ones, for orders 1 to 3, and prunes it a little, a lot and all the
+way (every count halved). After each prune it checks that fewer states are
+left, that every follower of every state in a model built from what is left
+leads to a state with followers of its own, and that samples from the start
+are as long as they were before any pruning. Then it trains on more text
+and prunes again, so the trainer's state and contexts have to have come
+through.
+
+It also saves a small model and damages it: each of a bad follower word, a
+bad alias entry, an alias threshold over the count, followers counted but
+not there, a bad word end offset and a bad next context has to be refused
+by Load_Model, and single bit flips anywhere have to be either refused or
+load and sample without crashing. Prints ok or what went wrong and exits 1.
+*/
+
+#define main markov_main
+#include "markov.c"
+#undef main
+
+#define TESTWORDS 300000	//per round of training
+#define VOCAB 5000
+#define SAMPLES 64
+#define SAMPLEWORDS 200
+#define MODELWORDS 20000	//for the damaged models
+#define FLIPS 1000
+
+static int fails;
+
+// words of rank u^3 * VOCAB, so a handful make up most of the text
+static void make_text(int fd, unsigned int s, long words)
+{
+	struct xoshiro r;
+	char b[32];
+	long i;
+	FILE *f;
+
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0 || !(f = fdopen(dup(fd), "w"))) {
+		fprintf(stderr, "Can't write test text\n");
+		exit(1);
+	}
+	xo_seed(&r, s, 0);
+	for (i = 0; i < words; i++) {
+		double u = (double)xo_below(&r, 1 << 30) / (1 << 30);
+		unsigned long rank = (unsigned long)(u * u * u * VOCAB);
+		int n = 0;
+		do
+			b[n++] = 'a' + rank % 26;
+		while ((rank /= 26));
+		b[n++] = xo_below(&r, 10) ? ' ' : '\n';
+		fwrite(b, 1, n, f);
+	}
+	fclose(f);
+	lseek(fd, 0, SEEK_SET);
+}
+
+static void train(int fd, uint32_t *c, uint32_t *s)
+{
+	struct wordsrc in;
+	struct wordslice v[WORDBATCH];
+	int i, k;
+
+	if (wordsrc_open(&in, fd) < 0) {
+		fprintf(stderr, "Can't read test text\n");
+		exit(1);
+	}
+	while ((k = wordsrc_batch(&in, v, WORDBATCH))) {
+		for (i = 0; i < k; i++) {
+			unsigned int w = intern(&thew, v[i].w, v[i].len);
+			add_follower(&thee, &thed, *s, w, 1);
+			*s = step(&thed, c, w, 1);
+		}
+	}
+	wordsrc_close(&in);
+}
+
+// how many samples came out short, and followers that go nowhere but the trainer's state
+static void check(char *what, uint32_t s, long *len)
+{
+	struct model *m = model_build(&thed);
+	struct obuf o = { NULL, 0, 0 };
+	struct xoshiro r;
+	uint64_t i, j, dead = 0;
+	long k, shorter = 0;
+
+	for (i = 0; i < m->h->nstates; i++) {
+		struct mstate *p = &m->states[i];
+		for (j = 0; j < p->nf; j++) {
+			uint32_t t = model_lookup(m, p->next, m->f[p->f + j].w);
+			if (t == NOKEY || (!m->states[t].fcount && t != s))
+				dead++;
+		}
+	}
+	for (k = 0; k < SAMPLES; k++) {
+		long n;
+		o.n = 0;
+		xo_seed(&r, 1, k);
+		n = sample(m, SAMPLEWORDS, &r, &o);
+		if (len[k] < 0)
+			len[k] = n;
+		else if (n < len[k])
+			shorter++;
+	}
+	printf("order %d %-16s %8lu states %8lu followers: %lu lead nowhere, %ld of %d samples shorter\n",
+	       order, what, (unsigned long)m->h->nstates, (unsigned long)m->h->nfollow,
+	       (unsigned long)dead, shorter, SAMPLES);
+	if (dead || shorter)
+		fails++;
+	mfree(o.b);
+	model_free(m);
+}
+
+static void prune_check(char *what, uint32_t *c, uint32_t *s, unsigned long drop, long *len)
+{
+	uint32_t before = thed.st.count;
+
+	prune(&thed, &thee, c, s, drop);
+	if (thed.st.count >= before) {
+		printf("order %d %s: prune left %u of %u states\n", order, what, thed.st.count, before);
+		fails++;
+	}
+	check(what, *s, len);
+}
+
+static void write_file(char *file, char *b, size_t n)
+{
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		fprintf(stderr, "Can't write %s\n", file);
+		exit(1);
+	}
+	write_all(fd, b, n);
+	close(fd);
+}
+
+// loads b as a model, 1 if it was refused
+static int refused(char *file, char *b, size_t n)
+{
+	struct model *m;
+	struct obuf o = { NULL, 0, 0 };
+	struct xoshiro r;
+	int k;
+
+	write_file(file, b, n);
+	if (!(m = Load_Model(file, 0)))
+		return 1;
+	for (k = 0; k < 8; k++) {
+		xo_seed(&r, 1, k);
+		sample(m, SAMPLEWORDS, &r, &o);
+	}
+	mfree(o.b);
+	model_free(m);
+	return 0;
+}
+
+// save a model, then damage it
+static void damaged(int fd)
+{
+	uint32_t c[MAXORDER], start[MAXORDER], s;
+	char file[] = "/tmp/markov_modelXXXXXX", *b, *x;
+	struct model_header *h;
+	struct mstate *st;
+	struct follow *f;
+	struct alias *a;
+	uint64_t *w, i, last;
+	struct xoshiro r;
+	struct model *m;
+	size_t n;
+	int mfd = mkstemp(file), errfd, null = open("/dev/null", O_WRONLY), k, bad = 0, flips = 0;
+
+	if (mfd < 0 || null < 0) {
+		fprintf(stderr, "Can't make %s\n", file);
+		exit(1);
+	}
+	close(mfd);
+	order = 2;
+	newline = intern(&thew, (unsigned char *)"\n", 1);
+	for (k = 0; k < order; k++)
+		start[k] = newline;
+	window(&thed, c, start);
+	s = step(&thed, c, newline, 1);
+	make_text(fd, 99, MODELWORDS);
+	train(fd, c, &s);
+	m = model_build(&thed);
+	n = m->h->size;
+	b = mmalloc(n, "test model");
+	x = mmalloc(n, "test model");
+	memcpy(b, m->h, n);
+	memcpy(x, b, n);
+	model_free(m);
+	h = (struct model_header *)x;
+	st = (struct mstate *)(x + h->states);
+	f = (struct follow *)(x + h->follow);
+	a = (struct alias *)(x + h->alias);
+	w = (uint64_t *)(x + h->words);
+	for (i = 0; i < h->nstates && st[i].nf < 2; i++) ;	//one with a choice
+	last = h->nstates - 1;
+	fflush(stderr);
+	errfd = dup(2);
+	dup2(null, 2);		//what Load_Model says about each
+	memcpy(x, b, n);
+	if (refused(file, x, n))
+		bad |= 1;
+#define DAMAGE(what, bit) \
+	do { \
+		memcpy(x, b, n); \
+		what; \
+		if (!refused(file, x, n)) \
+			bad |= bit; \
+	} while (0)
+	DAMAGE(f[st[i].f + 1].w = h->nwords, 2);
+	DAMAGE(a[st[i].f + 1].alias = st[i].nf, 4);
+	DAMAGE(a[st[i].f].thresh = st[i].fcount + 1, 8);
+	DAMAGE((st[last].nf = 0, st[last].f = h->nfollow, st[last].fcount = 1), 16);
+	DAMAGE(w[h->nwords] = 1UL << 40, 32);
+	DAMAGE(st[i].next ^= 0x5555, 64);
+	xo_seed(&r, 7, 0);
+	for (k = 0; k < FLIPS; k++) {
+		memcpy(x, b, n);
+		x[xo_below(&r, n)] ^= 1 << xo_below(&r, 8);
+		flips += refused(file, x, n);
+	}
+	fflush(stderr);
+	dup2(errfd, 2);
+	close(errfd);
+	close(null);
+	unlink(file);
+	printf("damaged models: %s, %d of %d bit flips refused, the rest sampled\n",
+	       bad ? "some not refused" : "all refused", flips, FLIPS);
+	if (bad) {
+		printf("  %s%s%s%s%s%s%s\n", bad & 1 ? "the good one refused " : "",
+		       bad & 2 ? "follower word " : "", bad & 4 ? "alias " : "", bad & 8 ? "threshold " : "",
+		       bad & 16 ? "fcount " : "", bad & 32 ? "word end " : "", bad & 64 ? "next " : "");
+		fails++;
+	}
+	mfree(b);
+	mfree(x);
+	free_dictionary(&thed);
+	words_free(&thew);
+	mfree(thee.t);
+	memset(&thee, 0, sizeof(struct edges));
+}
+
+int main(void)
+{
+	uint32_t c[MAXORDER], start[MAXORDER], s;
+	long len[SAMPLES];
+	char name[] = "/tmp/markov_testXXXXXX";
+	int fd = mkstemp(name), i, k;
+
+	if (fd < 0) {
+		fprintf(stderr, "Can't make %s\n", name);
+		exit(1);
+	}
+	unlink(name);
+	for (order = 1; order <= 3; order++) {
+		newline = intern(&thew, (unsigned char *)"\n", 1);
+		for (i = 0; i < order; i++)
+			start[i] = newline;
+		window(&thed, c, start);
+		s = step(&thed, c, newline, 1);
+		make_text(fd, order, TESTWORDS);
+		train(fd, c, &s);
+		for (k = 0; k < SAMPLES; k++)
+			len[k] = -1;
+		check("trained", s, len);
+		for (k = 0; k < SAMPLES; k++)
+			if (len[k] < SAMPLEWORDS) {
+				printf("order %d: sample %d is only %ld words before pruning\n", order, k, len[k]);
+				fails++;
+			}
+		prune_check("pruned 1/8", c, &s, thee.count / 8, len);
+		prune_check("pruned 1/2", c, &s, thee.count / 2, len);
+		prune_check("halved", c, &s, ~0UL, len);
+		make_text(fd, order + 10, TESTWORDS);
+		train(fd, c, &s);
+		check("trained more", s, len);
+		prune_check("halved again", c, &s, ~0UL, len);
+		free_dictionary(&thed);
+		words_free(&thew);
+		mfree(thee.t);
+		memset(&thee, 0, sizeof(struct edges));
+	}
+	damaged(fd);
+	close(fd);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -13,6 +13,7 @@ Example code for using one-way queues
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include "perfctr.h"
 
 // start with integer queues
 typedef int owq_element_t;
@@ -49,15 +50,18 @@ struct pinfo {
 	int test;
 	char *m;
 	owq_t *q;
+	struct perfctr *pc;	//producer's counters then consumer's
 };
 struct dpinfo {
 	int *poison;
 	int test;
 	char *m;
 	owq2_t *q;
+	struct perfctr *pc;
 };
 void twothreads(char *m, owq_t * q);
 void twodthreads(char *m, owq2_t * q);
+void counters(char *m, struct perfctr *pc);
 #define REPETITIONS (1024*1024*1020)
 #define MAXSLEEP 100000
 
@@ -65,6 +69,7 @@ int main(int argc, char **argv)
 {
 	int repeat_count = 1;
 	int test_number = 1;
+	struct perfctr probe;
 	if (argc > 1) {
 		if ((repeat_count = atoi(argv[1])) <= 0) {
 			fprintf(stderr, "Bad repetition count\n");
@@ -73,6 +78,11 @@ int main(int argc, char **argv)
 	}
 	printf
 	    ("Owq test with %d enqs. Short queue = %d elements. Long queue = %d elements\n",REPETITIONS, SHORTQ, LONGQ);
+	if (perfctr_open(&probe))
+		printf("Counting %d hardware events per thread\n", probe.n);
+	else
+		printf("No hardware performance counters, timing only\n");
+	perfctr_close(&probe);
 
 	while (repeat_count-- > 0) {
 		fprintf(stdout, "Run %d\n", test_number++);
@@ -92,7 +102,10 @@ void *iproducer(void *p)
 	int sleeps = 0;
 	struct pinfo pi = *(struct pinfo *)p;
 	owq_t *q = pi.q;
+	struct perfctr *pc = &pi.pc[0];
 
+	perfctr_open(pc);
+	perfctr_start(pc);
 	do {
 		if (owq_enq(q, n) == 0) {
 			n++;
@@ -103,6 +116,8 @@ void *iproducer(void *p)
 			}
 		}
 	} while (n < REPETITIONS && sleeps < MAXSLEEP);
+	perfctr_stop(pc);
+	perfctr_close(pc);
 
 	if (sleeps >= MAXSLEEP) {
 		fprintf(stderr, "  Int Producer oversleeps\n");
@@ -121,7 +136,10 @@ void *iconsumer(void *p)
 	int sleeps = 0;
 	struct pinfo pi = *(struct pinfo *)p;
 	owq_t *q = pi.q;
+	struct perfctr *pc = &pi.pc[1];
 
+	perfctr_open(pc);
+	perfctr_start(pc);
 	do {
 		if (owq_deq(q, &j) == 0) {
 			if (j != n) {
@@ -141,6 +159,8 @@ void *iconsumer(void *p)
 		}
 	}
 	while (sleeps < 2 * MAXSLEEP && (*(pi.poison) < 5));
+	perfctr_stop(pc);
+	perfctr_close(pc);
 
 	if (sleeps >= MAXSLEEP) {
 		fprintf(stderr, "  Int Consumer %s oversleeps\n", pi.m);
@@ -158,7 +178,10 @@ void *dproducer(void *p)
 	int count = 0;
 	struct dpinfo pi = *(struct dpinfo *)p;
 	owq2_t *q = pi.q;
+	struct perfctr *pc = &pi.pc[0];
 
+	perfctr_open(pc);
+	perfctr_start(pc);
 	do {
 		if (owq2_enq(q, n) == 0) {
 			n += 1.1;
@@ -170,6 +193,8 @@ void *dproducer(void *p)
 			}
 		}
 	} while (count < REPETITIONS && sleeps < MAXSLEEP);
+	perfctr_stop(pc);
+	perfctr_close(pc);
 
 	if (sleeps >= MAXSLEEP) {
 		fprintf(stderr, "  Dproducer %s oversleeps\n", pi.m);
@@ -189,7 +214,10 @@ void *dconsumer(void *p)
 	int sleeps = 0;
 	struct dpinfo pi = *(struct dpinfo *)p;
 	owq2_t *q = pi.q;
+	struct perfctr *pc = &pi.pc[1];
 
+	perfctr_open(pc);
+	perfctr_start(pc);
 	do {
 		if (owq2_deq(q, &j) == 0) {
 			if (j != n) {
@@ -210,6 +238,8 @@ void *dconsumer(void *p)
 		}
 	}
 	while (sleeps < 2 * MAXSLEEP && (*(pi.poison) < 5));
+	perfctr_stop(pc);
+	perfctr_close(pc);
 
 	if (sleeps >= MAXSLEEP) {
 		fprintf(stderr, "  DConsumer %s oversleeps\n", pi.m);
@@ -227,7 +257,8 @@ void twothreads(char *m, owq_t * q)
 	int r1, r2;
 	int poison = 0;
 	unsigned long elapsed = 0;
-	struct pinfo pi = {.poison = &poison,.q = q,.m = m };
+	struct perfctr pc[2];
+	struct pinfo pi = {.poison = &poison,.q = q,.m = m,.pc = pc };
 	pthread_t thread1, thread2;
 
 	r1 = pthread_create(&thread1, NULL, iproducer, (void *)&pi);
@@ -251,6 +282,7 @@ void twothreads(char *m, owq_t * q)
 	}
 	fprintf(stdout, "  %s took %ld milliseconds\n",
 		m, millisec() - elapsed);
+	counters(m, pc);
 }
 
 void twodthreads(char *m, owq2_t * q)
@@ -258,7 +290,8 @@ void twodthreads(char *m, owq2_t * q)
 	int r1, r2;
 	int poison = 0;
 	unsigned long elapsed = 0;
-	struct dpinfo pi = {.poison = &poison,.q = q,.m = m };
+	struct perfctr pc[2];
+	struct dpinfo pi = {.poison = &poison,.q = q,.m = m,.pc = pc };
 	pthread_t thread1, thread2;
 
 	r1 = pthread_create(&thread1, NULL, dproducer, (void *)&pi);
@@ -282,13 +315,25 @@ void twodthreads(char *m, owq2_t * q)
 	}
 	fprintf(stdout, "  %s took %ld milliseconds\n",
 		m, millisec() - elapsed);
+	counters(m, pc);
+}
+
+// counts per enq for the producer and per deq for the consumer
+void counters(char *m, struct perfctr *pc)
+{
+	char label[128];
+
+	snprintf(label, sizeof(label), "%s producer", m);
+	perfctr_print(stdout, &pc[0], label, REPETITIONS);
+	snprintf(label, sizeof(label), "%s consumer", m);
+	perfctr_print(stdout, &pc[1], label, REPETITIONS);
 }
 
 #include <time.h>
 unsigned long millisec(void)
 {
 	struct timespec t;
-	if (clock_gettime(CLOCK_REALTIME, &t)) {
+	if (clock_gettime(CLOCK_MONOTONIC, &t)) {
 		fprintf(stdout, "Can't read time\n");
 	}
 
@@ -41,6 +41,12 @@
 
     Probability of livelock increases with T.dropprob (steeply) and with number of acceptors less steeply
 
+    Any T field can be set on the command line as name=value, for example
+	lua paxos.lua acceptors=9 maxacceptors=9 dropprob=0.01 seed=3
+    seed=N makes a run repeatable (the default seeds from the clock) and csv=1 prints one
+    line of raw counts per acceptor count instead of the report - paxos_sweep.lua runs
+    many of these at once and adds them up.
+
     ]]
 
 
@@ -54,24 +60,34 @@ timeperround = 1000,  --- one move per time unit
 maxacceptors=35,
 dropprob = 0.001 --- probability message gets dropped
 }
+for _, s in ipairs (arg or {}) do
+	local k, v = string.match (s, "^(%w+)=(.+)$")
+	if k == nil or (T[k] == nil and k ~= "seed" and k ~= "csv") then
+		print ("use: lua paxos.lua [name=value ...] where name is a field of T, seed or csv")
+		os.exit (1)
+	end
+	T[k] = tonumber (v) or v
+end
 
+--[[
+    The proposer and acceptor tables are made once (newp, newa) and reset in place, so
+    the hot loop allocates nothing. A proposer contacts acceptors in order 1, 2, ... and
+    starts again from 1 when its phase changes or it times out, so the acceptors it has
+    contacted are always 1 .. nextax-1 and the ones that approved or accepted are a
+    subset of those: the sets are just the cursor nextax plus the counts napproved and
+    naccepted, and the majority test is one compare. Same moves, same random numbers,
+    same results as keeping the sets in tables.
+]]
 local p = { }
 local a = { } 
 local stat = {}
-function count (x, n)-- - how many non - nil entries up to n are in array
-	local c = 0
-	for i = 1, n do
-		if x [i] ~= nil then c = c + 1 end
-	end
-	return c;
-end
 
 function displayproposers (m, axes)-- print out proposer key values
     local v = nil print (m, "-------------------")
     for i = 1, T.proposers do
 	print (i, "id=", p[i].id, "phase=",
-	       p[i].phase, "v=", p[i].value, count (p[i].approved, axes),
-	       count (p[i].accepted, axes))
+	       p[i].phase, "v=", p[i].value, p[i].napproved,
+	       p[i].naccepted)
 	       if p[i].phase == 3 then
 		       if v == nil then v = p[i].value
 		       elseif v ~= p[i].value then print ("failed")
@@ -139,110 +155,136 @@ function displaystats ()
 			   "\nChance of livelock=", stat.livelocks / stat.runs, "Rounds without consensus=",
 			   T.rounds - stat.winning, "Highest id on livelock ", stat.livelockid)
 			   print("Time outs in phase 1",stat.timedoutphase1, "phase 2", stat.timedoutphase2)
+			   print("Rounds per second", string.format ("%.0f", stat.runs / math.max (stat.seconds, 1e-6)))
+end
+
+-- acceptors,proposers,dropprob,runs,failures,livelocks,livelockid,winners,winning,sumofvalues,timedoutphase1,timedoutphase2
+function csvstats ()
+	print (string.format ("%d,%d,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d", stat.acceptors, T.proposers,
+		tostring (T.dropprob), stat.runs, stat.failures, stat.livelocks, stat.livelockid,
+		stat.winners, stat.winning, stat.sumofvalues, stat.timedoutphase1, stat.timedoutphase2))
 end
 
 
 function pickvalue (n)-- - values are the ids of the proposer
 	local v
-	if p[n].bestv ~= nil then v = p[n].bestv
+	if p[n].bestv then v = p[n].bestv
 	else v = p[n].id end
 	return v
 end
 
 function newapproval (px, numa)
-	local ax;
+	local x = p[px]
 	-- try to find an acceptor  that will talk
-	for ax=1,numa do
-		if p[px].contacted[ax] ~= true then 
-			p[px].contacted[ax] = true
-			if (p[px].approved[ax] ~= true and a[ax].highestq <= p[px].id ) then -- ifq
-		--		print(px, p[px].id, "is approved by",ax)
-				p[px].approved[ax] = true;
-				a[ax].highestq = p[px].id
-				if p [px].bestq < a[ax].bestq then
-					p[px].bestq = a[ax].bestq
-					p[px].bestv = a[ax].bestv
-				end
-				if count(p[px].approved, numa) > numa / 2 then -- ifcount
-					p[px].phase = 2
-					p[px].value = pickvalue (px)
-					p[px].contacted = {}
-				end -- ifcount
-				return true
-			end-- ifq
-		end
+	while x.nextax <= numa do
+		local ax = a[x.nextax]
+		x.nextax = x.nextax + 1
+		if ax.highestq <= x.id then -- ifq
+			x.napproved = x.napproved + 1
+			ax.highestq = x.id
+			if x.bestq < ax.bestq then
+				x.bestq = ax.bestq
+				x.bestv = ax.bestv
+			end
+			if x.napproved > numa / 2 then -- ifcount
+				x.phase = 2
+				x.value = pickvalue (px)
+				x.nextax = 1
+			end -- ifcount
+			return true
+		end-- ifq
 	end
 	-- at this point we've contacted everyone and can't win, so reset with higher id
 		initonep (px)
-		p[px].id = p[px].id + T.proposers
+		x.id = x.id + T.proposers
 		stat.timedoutphase1 = stat.timedoutphase1 +1
 		return
 end
 
 
 function newaccept (px, numa)
+	local x = p[px]
 	-- try to find an acceptor  that likes us 
-	for ax=1,numa do
-		if p[px].contacted[ax] ~= true then 
-			p[px].contacted[ax]= true
-			if (p[px].accepted[ax] ~= true and a[ax].highestq <= p[px].id) then-- ifq
-				p[px].accepted[ax] = true ;
-				if a[ax].bestq < p[px].id then
-					a[ax].bestq = p[px].id
-					a[ax].bestv = p[px].value
-				end
-				if count(p[px].accepted, numa) > (numa / 2) then
-					p[px].phase = 3
-					p[px].contacted = {}
-					-- print(px,p[px].id,  " wins");
-				end -- count
-				return
-			end-- ifq
-		end -- end of for loop.
+	while x.nextax <= numa do
+		local ax = a[x.nextax]
+		x.nextax = x.nextax + 1
+		if ax.highestq <= x.id then-- ifq
+			x.naccepted = x.naccepted + 1
+			if ax.bestq < x.id then
+				ax.bestq = x.id
+				ax.bestv = x.value
+			end
+			if x.naccepted > (numa / 2) then
+				x.phase = 3
+				x.nextax = 1
+				-- print(px,x.id,  " wins");
+			end -- count
+			return
+		end-- ifq
 	end
 	-- at this point we've contacted everyone and can't win, so reset with higher id
---	print(px,p[px].id,"failed and increment id")
+--	print(px,x.id,"failed and increment id")
 		stat.timedoutphase2 = stat.timedoutphase2 +1
 		initonep (px)
-		p[px].id = p[px].id + T.proposers
+		x.id = x.id + T.proposers
 		return
 	end
 
+function newp ()
+	for i = 1, T.proposers do p[i] = { } initonep (i) end
+end
+
+function newa ()
+	for i = 1, T.maxacceptors do a[i] = { id = i } end
+	inita (T.maxacceptors)
+end
+
 function initp ()
 	for i = 1, T.proposers do initonep (i) end
 end
 
 function initonep (i)
-	p[i] = { id = i,  phase = 1, contacted ={},
-	approved = {}, accepted = {}, value = 0, bestv = nil, bestq = 0 }
+	local x = p[i]
+	x.id = i x.phase = 1 x.value = 0 x.bestv = false x.bestq = 0
+	x.nextax = 1 x.napproved = 0 x.naccepted = 0
 end
 
-function inita ()
-	for i = 1, T.maxacceptors do
-		a[i] = { id = i, highestq = 0, bestv = nil, bestq = 0 }
+-- only the first numa are used in a round
+function inita (numa)
+	for i = 1, numa do
+		local x = a[i]
+		x.highestq = 0 x.bestv = false x.bestq = 0
 	end
 end
 
 --			main
 --
-	math.randomseed (os.time ())
+	math.randomseed (T.seed or os.time ())
+	local csv = T.csv and T.csv ~= 0  -- csv=0 is a number, and true
+	if not csv then
 	print ("Simulate Paxos Consensus with increasing numbers of acceptors\n");
 	print ("Proposers=", T.proposers, "\nTime per round =", T.timeperround, " Rounds=", T.rounds )
+	end
+	newp ()
+	newa ()
+	local random, proposers, dropprob = math.random, T.proposers, T.dropprob
 	for n= T.acceptors, T.maxacceptors, 2 do
 			  --foracceptors
 			  statinit(n)
+			  local start = os.clock ()
 			  for round = 1, T.rounds do --forround
 				  initp ();
-				  inita ();
+				  inita (n);
 				  for t = 1, T.timeperround do --fortime
-					  local px = math.random (T.proposers)
-					  if p [px].phase == 1 and math.random()> T.dropprob then newapproval (px, n)
-					  elseif p[px].phase == 2 and math.random()> T.dropprob  then newaccept(px, n)
+					  local px = random (proposers)
+					  if p [px].phase == 1 and random()> dropprob then newapproval (px, n)
+					  elseif p[px].phase == 2 and random()> dropprob  then newaccept(px, n)
 					  else break; -- someone won
 					  end
 				  end-- fortime
 				  stats (n)
 			  end
-			  displaystats()
+			  stat.seconds = os.clock () - start
+			  if csv then csvstats () else displaystats() end
 		  end
-		  print("Ax\tLlock%\tWinning\tAvg value")
+		  if not csv then print("Ax\tLlock%\tWinning\tAvg value") end
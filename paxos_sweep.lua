@@ -0,0 +1,187 @@
+--[[
+    Parallel parameter sweep for paxos.lua
+    (c) Victor Yodaiken 2016-2021. Same license as paxos.lua.
+
+    lua paxos_sweep.lua [name=value ...]
+
+	acceptors=7:35:2        acceptor counts: a list 7,9,11 or first:last:step
+	dropprob=0.001          drop probabilities, a list
+	proposers=5             proposer counts, a list
+	rounds=50000            rounds for each (acceptors, dropprob, proposers) point
+	chunk=10000             rounds per job
+	timeperround=1000
+	jobs=N                  worker processes at once, default the number of cores
+	seed=1                  job k runs with seed+k so every job has its own random numbers
+	out=file.csv            default standard output
+	lua=lua                 interpreter for the workers
+
+    Every point of the grid is cut into jobs of chunk rounds (the rounds of a
+    simulation are independent, each starts from fresh proposers and acceptors)
+    and each job is one "lua paxos.lua ... csv=1" worker process, writing to
+    its own temporary file, started biggest job first and collected as soon
+    as it is done, whichever that is. The counts
+    the workers print are added up per point (the highest livelock id is the
+    largest) and written as one CSV table, sorted by proposers, dropprob and
+    acceptors, with the livelock rate and the average winning id worked out.
+    A run with the same options and seed gives the same table for any jobs=.
+]]
+
+local O = {
+	acceptors = "7:35:2",
+	dropprob = "0.001",
+	proposers = "5",
+	rounds = 50000,
+	chunk = 10000,
+	timeperround = 1000,
+	seed = 1,
+	lua = "lua"
+}
+for _, s in ipairs (arg) do
+	local k, v = string.match (s, "^(%w+)=(.+)$")
+	if k == nil or (O[k] == nil and k ~= "jobs" and k ~= "out") then
+		print ("use: lua paxos_sweep.lua [acceptors=7:35:2] [dropprob=0.001,0.01] [proposers=5]")
+		print ("       [rounds=50000] [chunk=10000] [timeperround=1000] [jobs=N] [seed=1] [out=file.csv] [lua=lua]")
+		os.exit (1)
+	end
+	O[k] = v
+end
+
+-- "a,b,c" or "first:last:step" to a list of number strings
+function values (s)
+	local v = {}
+	local first, last, step = string.match (s, "^([%d.]+):([%d.]+):?([%d.]*)$")
+	if first then
+		first, last, step = tonumber (first), tonumber (last), tonumber (step) or 1
+		if not first or not last or step <= 0 then print ("bad range:", s) os.exit (1) end
+		-- first + i*step, not repeated adds, so 0.001:0.003:0.001 keeps 0.003
+		for i = 0, math.floor ((last - first) / step + 1e-9) do
+			v[#v + 1] = tostring (first + i * step)
+		end
+	else
+		for x in string.gmatch (s, "[^,]+") do
+			if tonumber (x) == nil then print ("not a number:", x) os.exit (1) end
+			v[#v + 1] = x
+		end
+	end
+	return v
+end
+
+function cores ()
+	local h = io.popen ("nproc 2>/dev/null || getconf _NPROCESSORS_ONLN")
+	local n = h and tonumber (h:read ("*l") or "")
+	if h then h:close () end
+	return n or 1
+end
+
+local rounds, chunk = tonumber (O.rounds), tonumber (O.chunk)
+local njobs = tonumber (O.jobs or cores ())
+local paxos = (string.match (arg[0], "^(.*/)") or "") .. "paxos.lua"
+
+-- the jobs
+local jobs = {}
+for _, pr in ipairs (values (O.proposers)) do
+	for _, d in ipairs (values (O.dropprob)) do
+		for _, ax in ipairs (values (O.acceptors)) do
+			local left = rounds
+			while left > 0 do
+				local r = math.min (chunk, left)
+				left = left - r
+				jobs[#jobs + 1] = { acceptors = ax, dropprob = d, proposers = pr, rounds = r,
+					seed = tonumber (O.seed) + #jobs + 1,
+					cost = r * tonumber (ax) * tonumber (pr) }
+			end
+		end
+	end
+end
+
+-- biggest first so the last few running are short ones, the seeds stay with the jobs
+for i, j in ipairs (jobs) do j.index = i end
+table.sort (jobs, function (x, y)
+	if x.cost ~= y.cost then return x.cost > y.cost end
+	return x.index < y.index
+end)
+
+-- the sums for each point
+local fields = { "runs", "failures", "livelocks", "livelockid", "winners", "winning",
+	"sumofvalues", "timedoutphase1", "timedoutphase2" }
+local points = {}
+local order = {}
+
+function add (j, line)
+	local v = {}
+	for x in string.gmatch (line, "[^,]+") do v[#v + 1] = tonumber (x) end
+	if #v ~= 12 then return false end
+	local key = j.proposers .. "|" .. j.dropprob .. "|" .. j.acceptors
+	local pt = points[key]
+	if pt == nil then
+		pt = { acceptors = tonumber (j.acceptors), dropprob = tonumber (j.dropprob),
+			proposers = tonumber (j.proposers), dropname = j.dropprob }
+		for _, f in ipairs (fields) do pt[f] = 0 end
+		points[key] = pt
+		order[#order + 1] = pt
+	end
+	for i, f in ipairs (fields) do
+		if f == "livelockid" then pt[f] = math.max (pt[f], v[i + 3])
+		else pt[f] = pt[f] + v[i + 3] end
+	end
+	return true
+end
+
+-- run them njobs at a time: each worker writes j.file.part and renames it to j.file when
+-- it exits, so a finished job is one whose file can be opened
+local tmp = os.tmpname ()
+local running = {}
+local started, done = 0, 0
+local t0 = os.time ()
+while done < #jobs do
+	while started < #jobs and #running < njobs do
+		started = started + 1
+		local j = jobs[started]
+		local cmd = string.format ("%s %s csv=1 seed=%d proposers=%s acceptors=%s maxacceptors=%s dropprob=%s rounds=%d timeperround=%s",
+			O.lua, paxos, j.seed, j.proposers, j.acceptors, j.acceptors,
+			j.dropprob, j.rounds, O.timeperround)
+		j.file = tmp .. "." .. started
+		os.execute (string.format ("(%s > %s.part 2>&1; mv %s.part %s) &", cmd, j.file, j.file, j.file))
+		running[#running + 1] = j
+	end
+	local finished = false
+	for i = #running, 1, -1 do
+		local j = running[i]
+		local h = io.open (j.file)
+		if h then
+			table.remove (running, i)
+			finished = true
+			local got = false
+			for line in h:lines () do
+				if string.match (line, "^%d+,") then got = add (j, line) or got end
+			end
+			h:close ()
+			os.remove (j.file)
+			if not got then
+				io.stderr:write ("worker for acceptors=" .. j.acceptors .. " dropprob=" .. j.dropprob ..
+					" proposers=" .. j.proposers .. " printed no results\n")
+				os.exit (1)
+			end
+			done = done + 1
+			io.stderr:write (string.format ("\r%d of %d jobs", done, #jobs))
+		end
+	end
+	if not finished then os.execute ("sleep 0.1") end
+end
+os.remove (tmp)
+io.stderr:write (string.format ("\n%d jobs on %d workers in %d seconds\n", #jobs, njobs, os.time () - t0))
+
+table.sort (order, function (x, y)
+	if x.proposers ~= y.proposers then return x.proposers < y.proposers end
+	if x.dropprob ~= y.dropprob then return x.dropprob < y.dropprob end
+	return x.acceptors < y.acceptors
+end)
+local out = O.out and assert (io.open (O.out, "w")) or io.stdout
+out:write ("acceptors,proposers,dropprob,rounds,livelocks,livelock_rate,winning,avg_winning_id,winners,failures,highest_livelock_id,timedoutphase1,timedoutphase2\n")
+for _, pt in ipairs (order) do
+	out:write (string.format ("%d,%d,%s,%d,%d,%.6f,%d,%.3f,%d,%d,%d,%d,%d\n",
+		pt.acceptors, pt.proposers, pt.dropname, pt.runs, pt.livelocks, pt.livelocks / pt.runs,
+		pt.winning, pt.winning > 0 and pt.sumofvalues / pt.winning or 0, pt.winners,
+		pt.failures, pt.livelockid, pt.timedoutphase1, pt.timedoutphase2))
+end
+if out ~= io.stdout then out:close () end
@@ -0,0 +1,183 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Benchmark for smalloc.h: a producer thread allocates message buffers
+and passes them through a one-way-queue to a consumer thread which
+checks and frees them. So every free is a cross thread free.
+The same run is done with malloc/free and with smalloc/sfree.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "smalloc.h"
+
+typedef char *owq_element_t;
+#include "owq.h"
+typedef struct owq_struct owq_t;
+
+void *producer(void *p);
+void *consumer(void *p);
+
+#define QSIZE 1024
+char *qspace[QSIZE];
+owq_t q = {.t = 0,.h = 0,.v = qspace,.z = QSIZE };
+
+#define REPETITIONS (1024*1024*16)
+#define MAXSLEEP 100000
+
+static void *m_alloc(size_t n)
+{
+	return mmalloc(n, "message buffer");
+}
+
+static void *s_alloc(size_t n)
+{
+	return smalloc(n, "message buffer");
+}
+
+struct allocator {
+	char *m;
+	void *(*alloc)(size_t);
+	void (*free)(void *);
+} allocators[] = {
+	{.m = "malloc/free",.alloc = m_alloc,.free = mfree},
+	{.m = "smalloc/sfree",.alloc = s_alloc,.free = sfree},
+};
+
+#define NALLOCATORS (sizeof(allocators)/sizeof(allocators[0]))
+
+// message sizes wander over the small classes
+static inline int msgsize(int n)
+{
+	return 16 + (n * 37) % 1000;
+}
+
+void twothreads(struct allocator *a);
+
+int main(int argc, char **argv)
+{
+	int repeat_count = 1;
+	int test_number = 1;
+	unsigned int i;
+	if (argc > 1) {
+		if ((repeat_count = atoi(argv[1])) <= 0) {
+			fprintf(stderr, "Bad repetition count\n");
+			exit(1);
+		}
+	}
+	printf("Allocator test with %d cross thread allocations. Queue = %d elements\n",
+	     REPETITIONS, QSIZE);
+
+	while (repeat_count-- > 0) {
+		fprintf(stdout, "Run %d\n", test_number++);
+		for (i = 0; i < NALLOCATORS; i++) {
+			q.h = q.t = 0;
+			twothreads(&allocators[i]);
+		}
+	}
+#ifdef MMALLOC_ACCOUNTING
+	mmalloc_dump(stdout);
+#endif
+}
+
+void *producer(void *p)
+{
+	struct allocator *a = (struct allocator *)p;
+	int n = 0;
+	int sleeps = 0;
+	char *b = NULL;
+
+	do {
+		if (!b) {
+			int z = msgsize(n);
+			b = a->alloc(z);
+			*(int *)b = n;
+			b[z - 1] = (char)n;
+		}
+		if (owq_enq(&q, b) == 0) {
+			b = NULL;
+			n++;
+			sleeps = 0;
+		} else if (sleeps++ > 10000) {
+			usleep(1);
+		}
+	} while (n < REPETITIONS && sleeps < MAXSLEEP);
+
+	if (sleeps >= MAXSLEEP) {
+		fprintf(stderr, "  Producer %s oversleeps\n", a->m);
+		exit(0);
+	}
+	return 0;
+}
+
+void *consumer(void *p)
+{
+	struct allocator *a = (struct allocator *)p;
+	int n = 0;
+	int sleeps = 0;
+	char *b;
+
+	do {
+		if (owq_deq(&q, &b) == 0) {
+			if (*(int *)b != n || b[msgsize(n) - 1] != (char)n) {
+				fprintf(stderr,
+					"  Consumer %s sequence error at %d\n",
+					a->m, n);
+				exit(0);
+			}
+			a->free(b);
+			n++;
+			sleeps = 0;
+		} else {
+			if (sleeps > 1000)
+				usleep(1);
+			sleeps++;
+		}
+	} while (n < REPETITIONS && sleeps < 2 * MAXSLEEP);
+
+	if (n != REPETITIONS)
+		fprintf(stderr, "  Consumer %s oversleeps after %d frees\n",
+			a->m, n);
+	return 0;
+}
+
+unsigned long millisec(void);
+
+void twothreads(struct allocator *a)
+{
+	int r1, r2;
+	unsigned long elapsed = millisec();
+	pthread_t thread1, thread2;
+
+	r1 = pthread_create(&thread1, NULL, producer, (void *)a);
+	r2 = pthread_create(&thread2, NULL, consumer, (void *)a);
+	if (r1 || r2) {
+		fprintf(stdout,
+			"  %s thread create returns: %d %d\n", a->m, r1, r2);
+		exit(0);
+	}
+
+	pthread_join(thread1, NULL);
+	pthread_join(thread2, NULL);
+
+	fprintf(stdout, "  %s took %ld milliseconds\n",
+		a->m, millisec() - elapsed);
+}
+
+unsigned long millisec(void)
+{
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t)) {
+		fprintf(stdout, "Can't read time\n");
+	}
+
+	return t.tv_sec * 1000 + ((unsigned long)t.tv_nsec) / (1000 * 1000);
+}
@@ -2,6 +2,8 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
+#include "perfctr.h"
 
  //gcc needs this volatile with O3 to force load but clang does not
 volatile unsigned int shared = 0;
@@ -12,8 +14,12 @@ void *mythread(void *whoami)
 {
 	int id = (int)whoami;
 	unsigned int last = id;
+	uint64_t increments = 0;	//last wraps on a long run
+	struct perfctr pc;
 
 	printf("thread %d\n", id);
+	perfctr_open(&pc);
+	perfctr_start(&pc);
 
 	while (!die) {
 		while (gate != id) ;
@@ -25,14 +31,20 @@ void *mythread(void *whoami)
 		} else {
 			shared++;
 			last += 2;
+			increments++;
 			//if the compiler misbehaves we might need this
 			//asm("" : /* no output */ : /* no input */ : "memory");
 			gate = (id ? 0 : 1);
 
 		}
 	}
+	perfctr_stop(&pc);
 	fprintf(stderr, "ended thread %d normally with shared = %d\n", id,
 		shared);
+	//each handoff is a cache line moving between cores, the counters show what it costs
+	perfctr_print(stderr, &pc, id ? "thread 1 increment" : "thread 0 increment",
+		      increments);
+	perfctr_close(&pc);
 	return whoami;
 }
 
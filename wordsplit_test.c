@@ -0,0 +1,169 @@
+/* (c) Victor Yodaiken. All rights reserved.
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Test and benchmark for wordsplit.h
+
+ use: wordsplit_test [file]
+
+Splits the file (or some generated text) into words three ways: the byte
+at a time isalpha/isspace loop in wordsrc_next, wordsplit with scalar masks
+and wordsplit with SIMD masks. Checks that all three find the same words and
+prints the time and MB/s for each.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include "wordsrc.h"
+
+#define TEXTSIZE (128*1024*1024)	//generated text if no file is given
+#define BATCH 1024
+#define REPEAT 5
+
+struct result {
+	long words;
+	unsigned long sum;	//checksum over the words and where they are
+};
+
+static unsigned char *text;
+static size_t textn;
+
+unsigned long millisec(void);
+
+static void gentext(void)
+{
+	static const char sep[] = "     \n\t,.;\"(";
+	unsigned long r = 12345;
+	size_t i = 0;
+
+	text = (unsigned char *)mmalloc(TEXTSIZE, "test text");
+	while (i < TEXTSIZE) {
+		int len, j;
+		r = r * 6364136223846793005UL + 1442695040888963407UL;
+		len = 1 + (r >> 33) % 12;
+		for (j = 0; j < len && i < TEXTSIZE; j++)
+			text[i++] = 'a' + (r >> (j * 2 + 20)) % 26 - ((r >> 60) & 1) * 32;
+		if (i < TEXTSIZE)
+			text[i++] = sep[(r >> 40) % (sizeof(sep) - 1)];
+	}
+	textn = TEXTSIZE;
+}
+
+static inline void add(struct result *x, unsigned char *w, int len)
+{
+	x->words++;
+	x->sum = x->sum * 31 + (w - text) * 7 + len;
+}
+
+static struct result bytewise(void)
+{
+	struct wordsrc s = {.buf = text,.n = textn,.size = textn,.eof = 1,.stable = 1,.fd = -1 };
+	struct result x = { 0, 0 };
+	unsigned char *w;
+	int len;
+
+	while (wordsrc_next(&s, &w, &len))
+		add(&x, w, len);
+	return x;
+}
+
+static struct result split(int (*f)(unsigned char *, size_t, size_t *, int, struct wordslice *, int))
+{
+	struct wordslice v[BATCH];
+	struct result x = { 0, 0 };
+	size_t at = 0;
+	int i, k;
+
+	while ((k = f(text, textn, &at, 1, v, BATCH)))
+		for (i = 0; i < k; i++)
+			add(&x, v[i].w, v[i].len);
+	return x;
+}
+
+static struct result split_simd(void)
+{
+	return split(wordsplit);
+}
+
+static struct result split_scalar(void)
+{
+	return split(wordsplit_scalar);
+}
+
+struct method {
+	char *m;
+	struct result (*f)(void);
+} methods[] = {
+	{"isalpha/isspace loop", bytewise},
+	{"wordsplit scalar masks", split_scalar},
+	{"wordsplit simd masks", split_simd},
+};
+
+#define NMETHODS (sizeof(methods)/sizeof(methods[0]))
+
+int main(int argc, char **argv)
+{
+	struct result first = { 0, 0 };
+	unsigned int i;
+
+	if (argc > 1) {
+		struct wordsrc s;
+		int fd = open(argv[1], O_RDONLY);
+		if (fd < 0 || wordsrc_open(&s, fd) < 0 || !s.stable) {
+			fprintf(stderr, "Can't map %s\n", argv[1]);
+			exit(1);
+		}
+		text = s.buf;
+		textn = s.n;
+	} else
+		gentext();
+	printf("Word split test on %lu bytes, best of %d, simd=%s\n",
+	       (unsigned long)textn, REPEAT,
+#if defined(__AVX2__)
+	       "avx2"
+#elif WS_SIMD
+	       "sse2"
+#else
+	       "none"
+#endif
+	    );
+
+	for (i = 0; i < NMETHODS; i++) {
+		unsigned long best = ~0UL;
+		struct result x = { 0, 0 };
+		int r;
+		for (r = 0; r < REPEAT; r++) {
+			unsigned long t = millisec();
+			x = methods[i].f();
+			if ((t = millisec() - t) < best)
+				best = t;
+		}
+		if (i == 0)
+			first = x;
+		else if (x.words != first.words || x.sum != first.sum) {
+			fprintf(stderr, "  %s disagrees: %ld words, expected %ld\n",
+				methods[i].m, x.words, first.words);
+			exit(1);
+		}
+		printf("  %-24s %ld words %lu milliseconds %.0f MB/s\n",
+		       methods[i].m, x.words, best,
+		       best ? textn / (best * 1000.0) : 0.0);
+	}
+	return 0;
+}
+
+unsigned long millisec(void)
+{
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t)) {
+		fprintf(stdout, "Can't read time\n");
+	}
+
+	return t.tv_sec * 1000 + ((unsigned long)t.tv_nsec) / (1000 * 1000);
+}